@@ -0,0 +1,546 @@
+/*
+  ==============================================================================
+
+    BeatGenerator.h
+
+    Turns the step settings into one timeline per beat. A background thread
+    keeps the next few beats generated ahead of the playhead and hands them
+    over through a lock-free FIFO, so at a beat boundary the audio thread only
+    picks up a finished timeline instead of building one on the busiest block
+    of the beat. Each timeline is tagged with the song beat it was made for
+    and the version of the lookahead it belongs to.
+
+    The audio thread reports the transport every block, so the ready beats
+    start where a stopped transport will start and wrap with the loop. A
+    settings change, a loop change or a jump starts a new version; the older
+    ready beats are thrown away and the background thread refills from the
+    playhead. When nothing ready fits, the audio thread generates the one
+    beat it needs itself; it never plays a silent beat instead.
+
+    It runs on the SharedBackgroundThread that all instances share.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "RhythmGenerators.h"
+#include "StepRandom.h"
+#include "PatternLanguage.h"
+#include "SharedBackgroundThread.h"
+#include "TripleBuffer.h"
+
+//==============================================================================
+/** The fired steps of one beat, with everything random already resolved.
+    Positions and lengths are in beats, so a timeline generated ahead of time
+    still fits if the tempo changes before it is played.
+*/
+struct StepTimeline
+{
+    static constexpr int maxRatchets = 8;
+    static constexpr int maxSteps = Rhythm::maxSteps * maxRatchets;
+
+    int64 beat = 0;                 // the song beat, floor (ppq), this was generated for
+    uint32 version = 0;             // of the lookahead it was generated for
+    int numSteps = 0;
+    int humanize = 0;               // the largest delay, in samples
+    double position[maxSteps];      // within the beat, before humanize
+    float slotLength[maxSteps];     // humanize never pushes a hit past its slot
+    float length[maxSteps];
+    float timing[maxSteps];         // fraction of the largest delay
+    uint8 velocity[maxSteps];
+    float noteDraw[maxSteps];
+};
+
+static_assert (Rhythm::maxSteps * PatternProgram::maxSubSteps <= StepTimeline::maxSteps,
+               "a pattern beat must fit in one timeline");
+
+//==============================================================================
+class BeatGenerator  : private TimeSliceClient
+{
+public:
+    /** A snapshot of the parameters that shape a beat. */
+    struct Settings
+    {
+        Rhythm::Algorithm algorithm;
+        int numNotes, beatDivision, rotation, ratchets, humanize;
+        float probability, velocityRandom, ratchetDecay;
+    };
+
+    using SettingsReader = std::function<Settings()>;
+
+    /** Beats kept ready ahead of the one playing, so a block that crosses
+        several beat boundaries still finds them all generated. A parameter or
+        pattern change throws them away, so it is heard from the next beat.
+    */
+    static constexpr int lookaheadBeats = 4;
+
+    //==============================================================================
+    BeatGenerator (PatternSlot& slot, SettingsReader reader)
+        : patternSlot (slot),
+          readSettings (std::move (reader))
+    {
+    }
+
+    ~BeatGenerator() override
+    {
+        thread->removeTimeSliceClient (this);
+    }
+
+    /** Restarts the beat sequence from the first beat of seed and fills the
+        lookahead from song beat 0. Call while the audio thread is stopped, e.g.
+        from prepareToPlay. Without runInBackground, nextBeat() generates on the
+        calling thread, which keeps offline renders exact however fast the host
+        pulls blocks.
+    */
+    void reset (uint32 seed, bool runInBackground)
+    {
+        thread->removeTimeSliceClient (this);
+
+        // so generating never allocates
+        beatMap.reserve (Rhythm::maxSteps);
+
+        randomSeed = seed;
+        beatCounter = 0;
+        current = nullptr;
+        numInlineBeats = 0;
+        fifo.reset();
+
+        isBackground = runInBackground;
+        wasBackground = runInBackground;
+        lastBeat = 0;
+        plannedSettings = getSettingsVersion();
+        plan.firstBeat = 0;
+        plan.isLooping = false;
+        publishPlan();
+
+        if (runInBackground)
+            fill();
+
+        thread->addClient (this);
+    }
+
+    /** Switches between generating ahead and in line, for a host that goes
+        offline or back to realtime without preparing again. Any thread.
+    */
+    void setRunInBackground (bool shouldRunInBackground) noexcept
+    {
+        isBackground = shouldRunInBackground;
+    }
+
+    /** Any thread, e.g. from a parameter listener: something that shapes the
+        beats changed, so the ready ones are out of date.
+    */
+    void settingsChanged() noexcept
+    {
+        settingsVersion++;
+    }
+
+    //==============================================================================
+    /** Audio thread, at the start of every block, playing or not: keeps the
+        lookahead on the beats the transport is going to play. Ready beats the
+        playhead has passed are thrown away. When they can't be the right ones
+        any more, i.e. the settings or the loop changed, the stopped playhead
+        moved or the transport jumped, the lookahead restarts at the playhead.
+    */
+    void followTransport (const AudioPlayHead::CurrentPositionInfo& info) noexcept
+    {
+        const auto beat = (int64) std::floor (info.ppqPosition);
+        const bool background = isBackground;
+        const auto settings = getSettingsVersion();
+
+        const bool moved = beat != lastBeat && ! (info.isPlaying && follows (lastBeat, beat));
+        const bool loopChanged = info.isLooping != plan.isLooping
+                                  || (info.isLooping && (info.ppqLoopStart != plan.loopStart || info.ppqLoopEnd != plan.loopEnd));
+
+        lastBeat = beat;
+
+        if (background && (moved || loopChanged || settings != plannedSettings || ! wasBackground))
+        {
+            plannedSettings = settings;
+            plan.firstBeat = beat;
+            plan.isLooping = info.isLooping;
+            plan.loopStart = info.ppqLoopStart;
+            plan.loopEnd = info.ppqLoopEnd;
+            publishPlan();
+        }
+
+        wasBackground = background;
+
+        if (background)
+            dropPassedBeats (beat);
+    }
+
+    /** Audio thread: the timeline for song beat. Asking for the beat that is
+        already playing, e.g. after a resync or a re-struck chord inside it,
+        hands the same timeline back. Ready beats before it are thrown away.
+        If nothing ready fits, the beat is generated here; the background
+        thread holds the generator for one beat at a time, so that waits at
+        most as long as generating a beat. The timeline stays valid until the
+        next call.
+    */
+    const StepTimeline& nextBeat (int64 beat) noexcept
+    {
+        if (current != nullptr && current->beat == beat)
+            return *current;
+
+        current = &playing;
+
+        if (isBackground)
+        {
+            for (;;)
+            {
+                int start1, size1, start2, size2;
+                fifo.prepareToRead (1, start1, size1, start2, size2);
+
+                if (size1 + size2 == 0)
+                    break;
+
+                const auto& timeline = beats[size1 > 0 ? start1 : start2];
+                const bool fits = timeline.version == plan.version && timeline.beat == beat;
+
+                // copied out, so the slot goes straight back to the background thread
+                if (fits)
+                    playing = timeline;
+
+                fifo.finishedRead (1);
+
+                if (fits)
+                    return playing;
+            }
+
+            numInlineBeats++;
+        }
+
+        const SpinLock::ScopedLockType lock (generatorLock);
+        generate (playing, beat);
+        return playing;
+    }
+
+    /** Beats the audio thread had to generate itself while running in the
+        background, because the lookahead didn't have them ready, since the
+        last reset. A jump the transport didn't announce while stopped costs one.
+    */
+    int getNumInlineBeats() const noexcept      { return numInlineBeats; }
+
+private:
+    //==============================================================================
+    int useTimeSlice() override
+    {
+        if (isBackground)
+            fill();
+
+        return pollIntervalMs;
+    }
+
+    /** Where the background thread generates from, and how it follows the
+        loop. Published by the audio thread; a new version replaces the last.
+    */
+    struct Plan
+    {
+        uint32 version = 0;
+        int64 firstBeat = 0;
+        bool isLooping = false;
+        double loopStart = 0, loopEnd = 0;
+
+        /** The beat the transport plays after beat: from the one the loop ends
+            in, it goes back to the one the loop starts in.
+        */
+        int64 getBeatAfter (int64 beat) const noexcept
+        {
+            if (isLooping && loopEnd > loopStart && (double) beat < loopEnd && loopEnd <= (double) (beat + 1))
+                return (int64) std::floor (loopStart);
+
+            return beat + 1;
+        }
+    };
+
+    /** Whether a transport running on from beat from reaches beat to within
+        the lookahead, as a block may cross several beats.
+    */
+    bool follows (int64 from, int64 to) const noexcept
+    {
+        for (int i = 0; i < lookaheadBeats; ++i)
+        {
+            from = plan.getBeatAfter (from);
+
+            if (from == to)
+                return true;
+        }
+
+        return false;
+    }
+
+    uint32 getSettingsVersion() const noexcept
+    {
+        return settingsVersion.load() + patternSlot.getNumPublished();
+    }
+
+    /** Audio thread, or while it is stopped: starts a new version of the lookahead. */
+    void publishPlan() noexcept
+    {
+        plan.version++;
+        plans.getWriteBuffer() = plan;
+        plans.publish();
+    }
+
+    /** Drops ready beats from an older version, and ones the playhead has
+        passed. If that empties the lookahead, the background thread has
+        fallen behind the playhead, e.g. while no notes were held, so it
+        restarts there.
+    */
+    void dropPassedBeats (int64 beat) noexcept
+    {
+        bool droppedAny = false;
+
+        for (;;)
+        {
+            int start1, size1, start2, size2;
+            fifo.prepareToRead (1, start1, size1, start2, size2);
+
+            if (size1 + size2 == 0)
+                break;
+
+            const auto& timeline = beats[size1 > 0 ? start1 : start2];
+
+            if (timeline.version == plan.version && (timeline.beat == beat || follows (beat, timeline.beat)))
+                return;
+
+            droppedAny = droppedAny || timeline.version == plan.version;
+            fifo.finishedRead (1);
+        }
+
+        if (droppedAny)
+        {
+            plan.firstBeat = beat;
+            publishPlan();
+        }
+    }
+
+    /** Generates beats until the lookahead is full, holding the generator for
+        one beat at a time so the audio thread never waits longer than that.
+    */
+    void fill()
+    {
+        while (fifo.getFreeSpace() > 0)
+        {
+            const SpinLock::ScopedLockType lock (generatorLock);
+            const auto& latest = plans.acquire();
+
+            if (latest.version != generatingVersion)
+            {
+                generatingVersion = latest.version;
+                nextBeatToGenerate = latest.firstBeat;
+            }
+
+            int start1, size1, start2, size2;
+            fifo.prepareToWrite (1, start1, size1, start2, size2);
+
+            auto& timeline = beats[size1 > 0 ? start1 : start2];
+            generate (timeline, nextBeatToGenerate);
+            timeline.version = generatingVersion;
+            nextBeatToGenerate = latest.getBeatAfter (nextBeatToGenerate);
+
+            fifo.finishedWrite (1);
+        }
+    }
+
+    void generate (StepTimeline& timeline, int64 beat)
+    {
+        auto settings = readSettings();
+
+        // the processor swaps these back on its next block; don't read past the beat meanwhile
+        if (settings.numNotes > settings.beatDivision)
+            std::swap (settings.numNotes, settings.beatDivision);
+
+        draws.generate (randomSeed, beatCounter++);
+        timeline.beat = beat;
+        timeline.humanize = settings.humanize;
+
+        if (settings.algorithm == Rhythm::Algorithm::pattern)
+        {
+            generatePatternSteps (settings, timeline);
+        }
+        else
+        {
+            generateBeatMap (settings);
+            generateNoteDurations (settings, timeline);
+        }
+    }
+
+    //==============================================================================
+    void generateBeatMap (const Settings& settings)
+    {
+        const int numNotes = settings.numNotes;
+        const int beatDivision = settings.beatDivision;
+        beatMap.assign (beatDivision, 0);
+
+        Rhythm::StepMask mask = 0;
+
+        switch (settings.algorithm)
+        {
+            case Rhythm::Algorithm::euclidean:
+                mask = Rhythm::euclideanTable.get (numNotes, beatDivision);
+                break;
+
+            case Rhythm::Algorithm::accent:
+                mask = Rhythm::accentTable.get (numNotes, beatDivision);
+                break;
+
+            case Rhythm::Algorithm::density:
+            {
+                // every step fires with probability numNotes / beatDivision
+                for (int i = 0; i < beatDivision; i++)
+                    if (draws.placement[i] * beatDivision < numNotes)
+                        mask = (Rhythm::StepMask) (mask | (1u << i));
+                break;
+            }
+
+            case Rhythm::Algorithm::random:
+            case Rhythm::Algorithm::pattern:
+            default:
+            {
+                // partial Fisher-Yates shuffle, so each placement costs exactly one draw
+                int order[Rhythm::maxSteps];
+                for (int i = 0; i < beatDivision; i++)
+                    order[i] = i;
+
+                for (int i = 0; i < numNotes; i++)
+                {
+                    int x = i + (int) (draws.placement[i] * (beatDivision - i));
+                    std::swap (order[i], order[x]);
+                    beatMap[order[i]] = 1;
+                }
+                return;
+            }
+        }
+
+        mask = Rhythm::rotate (mask, settings.rotation, beatDivision);
+
+        for (int i = 0; i < beatDivision; i++)
+            beatMap[i] = (mask >> i) & 1;
+    }
+
+    /** Turns the beat map into timeline steps, applying the step probability and
+        resolving velocity, humanize and note choice from this beat's draws.
+        A ratcheted step becomes one timeline entry per retrigger.
+    */
+    void generateNoteDurations (const Settings& settings, StepTimeline& timeline)
+    {
+        const double offset = 1.0 / settings.beatDivision;
+        const int ratchets = jlimit (1, StepTimeline::maxRatchets, settings.ratchets);
+        const float ratchetGain = 1.0f - settings.ratchetDecay;
+        const double ratchetLength = offset / ratchets;
+
+        timeline.numSteps = 0;
+
+        for (int i = 0; i < (int) beatMap.size(); i++)
+        {
+            if (beatMap[i] == 1 && draws.fire[i] < settings.probability)
+            {
+                float velocity = 127.0f * (1.0f - settings.velocityRandom * draws.velocity[i]);
+
+                for (int r = 0; r < ratchets; r++)
+                {
+                    // half-length gates, so a retrigger always finds its previous note already off
+                    addStep (timeline, offset * i + ratchetLength * r, (float) ratchetLength,
+                             draws.timing[i], velocity, draws.note[i]);
+
+                    velocity *= ratchetGain;
+                }
+            }
+        }
+    }
+
+    /** Pattern mode: copies this beat's slice of the compiled instruction stream
+        into the timeline. The pattern is laid from song beat 0, so which of its
+        beats plays follows the song position through loops and jumps. A newly
+        published pattern only takes over at the start of a cycle of the old one.
+    */
+    void generatePatternSteps (const Settings& settings, StepTimeline& timeline)
+    {
+        const auto* program = &patternSlot.getProgram();
+
+        if (program->numBeats == 0 || getPatternBeat (*program, timeline.beat) == 0)
+            program = &patternSlot.acquireProgram();
+
+        timeline.numSteps = 0;
+
+        if (program->numBeats == 0)
+            return;
+
+        const int beat = getPatternBeat (*program, timeline.beat);
+
+        const float ratchetGain = 1.0f - settings.ratchetDecay;
+
+        for (int i = program->beatStart[beat]; i < program->beatStart[beat + 1]; i++)
+        {
+            const auto& instruction = program->instructions[i];
+            const int step = instruction.step;
+
+            if (draws.fire[step] >= instruction.probability * settings.probability)
+            {
+                continue;
+            }
+
+            const float velocity = instruction.velocity * (1.0f - settings.velocityRandom * draws.velocity[step])
+                                     * std::pow (ratchetGain, (float) instruction.ratchet);
+
+            addStep (timeline, instruction.offset, instruction.length,
+                     draws.timing[step], velocity, draws.note[step]);
+        }
+    }
+
+    /** Which beat of the pattern falls on songBeat; pre-roll beats count back from the end. */
+    static int getPatternBeat (const PatternProgram& program, int64 songBeat) noexcept
+    {
+        const auto beat = (int) (songBeat % program.numBeats);
+        return beat < 0 ? beat + program.numBeats : beat;
+    }
+
+    static void addStep (StepTimeline& timeline, double position, float slotLength, float timing, float velocity, float noteDraw)
+    {
+        const int n = timeline.numSteps++;
+
+        timeline.position[n] = position;
+        timeline.slotLength[n] = slotLength;
+        timeline.length[n] = slotLength * 0.5f;
+        timeline.timing[n] = timing;
+        timeline.velocity[n] = (uint8) jlimit (1, 127, roundToInt (velocity));
+        timeline.noteDraw[n] = noteDraw;
+    }
+
+    //==============================================================================
+    static constexpr int pollIntervalMs = 10;
+
+    PatternSlot& patternSlot;
+    SettingsReader readSettings;
+    SharedResourcePointer<SharedBackgroundThread> thread;
+
+    // generator state, only touched with generatorLock held
+    SpinLock generatorLock;
+    StepRandom::BeatDraws draws;
+    std::vector<int> beatMap;
+    uint32 randomSeed = 0;
+    uint32 beatCounter = 0;
+    int64 nextBeatToGenerate = 0;               // background thread only
+    uint32 generatingVersion = 0;               // background thread only
+
+    AbstractFifo fifo { lookaheadBeats + 1 };     // lookaheadBeats ready
+    StepTimeline beats[lookaheadBeats + 1];
+    TripleBuffer<Plan> plans;                   // written by the audio thread, read by fill()
+
+    // audio thread only
+    StepTimeline playing;                       // copied out of the lookahead, or generated here
+    const StepTimeline* current = nullptr;
+    Plan plan;                                  // the last one published
+    int64 lastBeat = 0;
+    bool wasBackground = false;
+    uint32 plannedSettings = 0;
+    std::atomic<int> numInlineBeats { 0 };
+
+    std::atomic<bool> isBackground { false };     // set from any thread by setRunInBackground()
+    std::atomic<uint32> settingsVersion { 0 };    // bumped from any thread by settingsChanged()
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BeatGenerator)
+};
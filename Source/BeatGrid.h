@@ -0,0 +1,63 @@
+/*
+  ==============================================================================
+
+    BeatGrid.h
+
+    Maps each block onto the beat grid from its own ppqPosition and tempo, and
+    tells a transport jump from a host rounding its positions. The arp's steps
+    and the MIDI clock's ticks both go through this, so they agree on where a
+    block starts, which blocks are jumps, and what a block still owns from
+    just before its first sample.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+class BeatGrid
+{
+public:
+    struct Block
+    {
+        double start, end;          // in ppq
+        double samplesPerBeat;
+        bool jumped;                // doesn't start where the last block ended, or follows a resync()
+
+        /** Anything from here on is this block's to play: a position less than
+            half a sample before the block still rounds onto its first sample.
+        */
+        double getEarliest() const noexcept         { return start - 0.5 / samplesPerBeat; }
+
+        /** The sample ppq rounds to, counted from the block start; negative
+            just before it, numSamples or more once past its end.
+        */
+        int getSample (double ppq) const noexcept   { return roundToInt ((ppq - start) * samplesPerBeat); }
+    };
+
+    //==============================================================================
+    /** Maps the next block onto the grid. */
+    Block next (const AudioPlayHead::CurrentPositionInfo& info, double sampleRate, int numSamples) noexcept
+    {
+        Block block;
+        block.samplesPerBeat = sampleRate * 60.0 / info.bpm;
+        block.start = info.ppqPosition;
+        block.end = block.start + numSamples / block.samplesPerBeat;
+
+        // hosts round their positions, so allow up to a sample of drift before calling it a jump
+        block.jumped = needsResync || std::abs (block.start - expectedStart) * block.samplesPerBeat > 1.0;
+
+        expectedStart = block.end;
+        needsResync = false;
+        return block;
+    }
+
+    /** The next block counts as a jump wherever it starts, e.g. after the
+        transport stopped or nothing was rendered for a while.
+    */
+    void resync() noexcept                          { needsResync = true; }
+
+private:
+    double expectedStart = 0;       // where the next block starts if the transport runs on
+    bool needsResync = true;
+};
@@ -51,51 +51,105 @@
 #pragma once
 #include <iostream>
 #include <array>
+#include "RhythmGenerators.h"
+#include "BeatGenerator.h"
+#include "HeldNotes.h"
+#include "PatternRecorder.h"
+#include "PatternLanguage.h"
+#include "MidiClock.h"
+#include "BeatGrid.h"
 
 class BeatPeggiatorEditor : public AudioProcessorEditor
 {
 public:
-    BeatPeggiatorEditor (AudioProcessor& p, AudioProcessorValueTreeState& vts)
+    BeatPeggiatorEditor (AudioProcessor& p, AudioProcessorValueTreeState& vts, PatternRecorder& r, PatternSlot& slot)
     : AudioProcessorEditor (p),
-      parameters (vts)
+      parameters (vts),
+      recorder (r),
+      patternSlot (slot)
     {
-        // num notes
-        numNotesSlider.setSliderStyle (Slider::SliderStyle::LinearHorizontal);
-        numNotesSlider.setTextBoxStyle (Slider::TextEntryBoxPosition::TextBoxBelow, true, 50, 10);
-        addAndMakeVisible (numNotesSlider);
+        setUpSlider (numNotesSlider, numNotesLabel, "Number of Notes");
+        setUpSlider (beatDivisionSlider, beatDivisionLabel, "Beat Division");
         
-        numNotesLabel.setFont(14.0f);
-        numNotesLabel.setText("Number of Notes", NotificationType::dontSendNotification);
-        numNotesLabel.attachToComponent(&numNotesSlider, true);
+        setUpSlider (beatsSlider, beatsLabel, "Beats");
+        beatsSlider.setEnabled(false);
         
-        // beat division
-        beatDivisionSlider.setSliderStyle (Slider::SliderStyle::LinearHorizontal);
-        beatDivisionSlider.setTextBoxStyle (Slider::TextEntryBoxPosition::TextBoxBelow, true, 50, 10);
-        addAndMakeVisible (beatDivisionSlider);
+        // rhythm algorithm
+        algorithmBox.addItemList (Rhythm::getAlgorithmNames(), 1);
+        addAndMakeVisible (algorithmBox);
         
-        beatDivisionLabel.setFont(14.0f);
-        beatDivisionLabel.setText("Beat Division", NotificationType::dontSendNotification);
-        beatDivisionLabel.attachToComponent(&beatDivisionSlider, true);
+        algorithmLabel.setFont(14.0f);
+        algorithmLabel.setText("Algorithm", NotificationType::dontSendNotification);
+        algorithmLabel.attachToComponent(&algorithmBox, true);
         
+        setUpSlider (rotationSlider, rotationLabel, "Rotation");
         
-        // beats
-        beatsSlider.setSliderStyle (Slider::SliderStyle::LinearHorizontal);
-        beatsSlider.setTextBoxStyle (Slider::TextEntryBoxPosition::TextBoxBelow, true, 50, 10);
-        beatsSlider.setEnabled(false);
-        addAndMakeVisible (beatsSlider);
+        // input routing
+        if (auto* routing = dynamic_cast<AudioParameterChoice*> (parameters.getParameter ("routing")))
+            routingBox.addItemList (routing->choices, 1);
+        
+        addAndMakeVisible (routingBox);
+        
+        routingLabel.setFont(14.0f);
+        routingLabel.setText("Routing", NotificationType::dontSendNotification);
+        routingLabel.attachToComponent(&routingBox, true);
+        
+        midiClockButton.setButtonText ("MIDI Clock Out");
+        addAndMakeVisible (midiClockButton);
+        
+        setUpSlider (probabilitySlider, probabilityLabel, "Probability");
+        setUpSlider (velocityRandomSlider, velocityRandomLabel, "Velocity Random");
+        setUpSlider (humanizeSlider, humanizeLabel, "Humanize (samples)");
+        setUpSlider (ratchetsSlider, ratchetsLabel, "Ratchets");
+        setUpSlider (ratchetDecaySlider, ratchetDecayLabel, "Ratchet Decay");
+        
+        // pattern capture
+        setUpSlider (captureBarsSlider, captureBarsLabel, "Capture Bars");
+        captureBarsSlider.setRange (1, PatternRecorder::maxBars, 1);
+        captureBarsSlider.setValue (4);
         
-        beatsLabel.setFont(14.0f);
-        beatsLabel.setText("Beats", NotificationType::dontSendNotification);
-        beatsLabel.attachToComponent(&beatsSlider, true);
+        exportButton.setButtonText ("Export MIDI");
+        exportButton.onClick = [this] { exportCapture(); };
+        addAndMakeVisible (exportButton);
+        
+        captureStatusLabel.setFont(12.0f);
+        addAndMakeVisible (captureStatusLabel);
+        
+        keepPatternButton.setButtonText ("Keep as Pattern");
+        keepPatternButton.onClick = [this] { keepCaptureAsPattern(); };
+        addAndMakeVisible (keepPatternButton);
+        
+        // pattern text
+        patternEditor.setText (patternSlot.getText(), false);
+        patternEditor.setTextToShowWhenEmpty ("x..x .x.. [xx] x?", Colours::grey);
+        patternEditor.onReturnKey = [this] { compilePattern(); };
+        patternEditor.onFocusLost = [this] { compilePattern(); };
+        addAndMakeVisible (patternEditor);
+        
+        patternLabel.setFont(14.0f);
+        patternLabel.setText("Pattern", NotificationType::dontSendNotification);
+        patternLabel.attachToComponent(&patternEditor, true);
+        
+        patternStatusLabel.setFont(12.0f);
+        addAndMakeVisible (patternStatusLabel);
         
 
         numNotesAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment> (parameters, "numNotes", numNotesSlider);
         beatDivisionAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment> (parameters, "beatDivision", beatDivisionSlider);
 
         beatsAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment> (parameters, "beats", beatsSlider);
+        algorithmAttachment = std::make_unique<AudioProcessorValueTreeState::ComboBoxAttachment> (parameters, "algorithm", algorithmBox);
+        routingAttachment = std::make_unique<AudioProcessorValueTreeState::ComboBoxAttachment> (parameters, "routing", routingBox);
+        midiClockAttachment = std::make_unique<AudioProcessorValueTreeState::ButtonAttachment> (parameters, "midiClock", midiClockButton);
+        rotationAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment> (parameters, "rotation", rotationSlider);
+        probabilityAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment> (parameters, "probability", probabilitySlider);
+        velocityRandomAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment> (parameters, "velocityRandom", velocityRandomSlider);
+        humanizeAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment> (parameters, "humanize", humanizeSlider);
+        ratchetsAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment> (parameters, "ratchets", ratchetsSlider);
+        ratchetDecayAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment> (parameters, "ratchetDecay", ratchetDecaySlider);
 
 
-        setSize (400, 800);
+        setSize (800, 700);
 
     }
     
@@ -126,23 +180,124 @@ public:
     void resized () override
     {
         auto bounds = getLocalBounds();
-        const int componentSize { 100 };
+        const int componentWidth { 200 };
+        const int componentHeight { 60 };
+        const int rowHeight { 90 };
+        
+        auto patternArea = bounds.removeFromBottom (100).reduced (20, 10).withTrimmedLeft (80);
+        patternEditor.setBounds (patternArea.removeFromTop (30));
+        patternStatusLabel.setBounds (patternArea.removeFromTop (24));
         
-        numNotesSlider.setBounds (bounds.removeFromTop (200).withSizeKeepingCentre (componentSize, componentSize));
-        beatDivisionSlider.setBounds (bounds.removeFromTop (200).withSizeKeepingCentre (componentSize, componentSize));
-        beatsSlider.setBounds (bounds.removeFromTop (200).withSizeKeepingCentre (componentSize, componentSize));
+        // labels are attached to the left of each control
+        auto left = bounds.removeFromLeft (bounds.getWidth() / 2).withTrimmedLeft (100);
+        auto right = bounds.withTrimmedLeft (100);
+        
+        numNotesSlider.setBounds (left.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        beatDivisionSlider.setBounds (left.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        beatsSlider.setBounds (left.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        algorithmBox.setBounds (left.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, 24));
+        rotationSlider.setBounds (left.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        routingBox.setBounds (left.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, 24));
+        midiClockButton.setBounds (left.removeFromTop (30).withSizeKeepingCentre (componentWidth, 24));
+        
+        probabilitySlider.setBounds (right.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        velocityRandomSlider.setBounds (right.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        humanizeSlider.setBounds (right.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        ratchetsSlider.setBounds (right.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        ratchetDecaySlider.setBounds (right.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        captureBarsSlider.setBounds (right.removeFromTop (rowHeight).withSizeKeepingCentre (componentWidth, componentHeight));
+        
+        auto captureRow = right.removeFromTop (30).withSizeKeepingCentre (componentWidth, 24);
+        exportButton.setBounds (captureRow.removeFromLeft (95));
+        captureRow.removeFromLeft (10);
+        keepPatternButton.setBounds (captureRow);
+        captureStatusLabel.setBounds (right.removeFromTop (30).withSizeKeepingCentre (componentWidth, 24));
     }
     
 private:
+    void exportCapture()
+    {
+        captureStatusLabel.setText ("Writing...", NotificationType::dontSendNotification);
+        
+        recorder.exportLastBars ((int) captureBarsSlider.getValue(), PatternRecorder::getDefaultExportFile(),
+                                 [safeThis = Component::SafePointer<BeatPeggiatorEditor> (this)] (const File& file, bool succeeded)
+                                 {
+                                     if (safeThis != nullptr)
+                                         safeThis->captureStatusLabel.setText (succeeded ? file.getFileName() : String ("Nothing captured"),
+                                                                               NotificationType::dontSendNotification);
+                                 });
+    }
+    
+    void keepCaptureAsPattern()
+    {
+        const int stepsPerBeat = (int) parameters.getRawParameterValue ("beatDivision")->load();
+        
+        recorder.captureLastBarsAsPattern ((int) captureBarsSlider.getValue(), stepsPerBeat,
+                                           [safeThis = Component::SafePointer<BeatPeggiatorEditor> (this)] (const String& text)
+                                           {
+                                               if (safeThis == nullptr)
+                                                   return;
+                                               
+                                               if (text.isEmpty())
+                                               {
+                                                   safeThis->captureStatusLabel.setText ("Nothing captured", NotificationType::dontSendNotification);
+                                                   return;
+                                               }
+                                               
+                                               safeThis->patternEditor.setText (text, false);
+                                               safeThis->compilePattern();
+                                               
+                                               if (auto* algorithm = safeThis->parameters.getParameter ("algorithm"))
+                                                   algorithm->setValueNotifyingHost (algorithm->convertTo0to1 ((float) Rhythm::Algorithm::pattern));
+                                           });
+    }
+    
+    void compilePattern()
+    {
+        const auto error = patternSlot.setText (patternEditor.getText());
+        patternStatusLabel.setText (error.isEmpty() ? String ("OK") : error, NotificationType::dontSendNotification);
+    }
+    
+    void setUpSlider (Slider& slider, Label& label, const String& text)
+    {
+        slider.setSliderStyle (Slider::SliderStyle::LinearHorizontal);
+        slider.setTextBoxStyle (Slider::TextEntryBoxPosition::TextBoxBelow, true, 50, 10);
+        addAndMakeVisible (slider);
+        
+        label.setFont(14.0f);
+        label.setText(text, NotificationType::dontSendNotification);
+        label.attachToComponent(&slider, true);
+    }
+    
+
     AudioProcessorValueTreeState& parameters;
+    PatternRecorder& recorder;
+    PatternSlot& patternSlot;
     
-    Slider numNotesSlider, beatDivisionSlider, beatsSlider;
-    Label numNotesLabel, beatDivisionLabel, beatsLabel, numNotesOutOfRangeLabel;
+    Slider numNotesSlider, beatDivisionSlider, beatsSlider, rotationSlider;
+    Slider probabilitySlider, velocityRandomSlider, humanizeSlider, ratchetsSlider, ratchetDecaySlider;
+    Slider captureBarsSlider;
+    TextButton exportButton, keepPatternButton;
+    ToggleButton midiClockButton;
+    TextEditor patternEditor;
+    ComboBox algorithmBox, routingBox;
+    Label numNotesLabel, beatDivisionLabel, beatsLabel, numNotesOutOfRangeLabel, algorithmLabel, rotationLabel, routingLabel;
+    Label probabilityLabel, velocityRandomLabel, humanizeLabel, ratchetsLabel, ratchetDecayLabel;
+    Label captureBarsLabel, captureStatusLabel, patternLabel, patternStatusLabel;
     
     
     std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> beatsAttachment;
     std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> beatDivisionAttachment;
     std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> numNotesAttachment;
+    std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> rotationAttachment;
+    std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> probabilityAttachment;
+    std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> velocityRandomAttachment;
+    std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> humanizeAttachment;
+    std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> ratchetsAttachment;
+    std::unique_ptr<AudioProcessorValueTreeState::SliderAttachment> ratchetDecayAttachment;
+    std::unique_ptr<AudioProcessorValueTreeState::ComboBoxAttachment> algorithmAttachment;
+    std::unique_ptr<AudioProcessorValueTreeState::ComboBoxAttachment> routingAttachment;
+    std::unique_ptr<AudioProcessorValueTreeState::ButtonAttachment> midiClockAttachment;
 
 
     //==============================================================================
@@ -151,24 +306,44 @@ private:
 
 
 //==============================================================================
-class BeatPeggiatorProcessor  : public AudioProcessor //, private AudioProcessorValueTreeState::Listener
+class BeatPeggiatorProcessor  : public AudioProcessor, private AudioProcessorValueTreeState::Listener
 {
 public:
+    static constexpr int maxRatchets = StepTimeline::maxRatchets;
+    static constexpr int maxPendingNoteOffs = 256;
+    static constexpr int maxEventsPerBlockLimit = 4096;
+    
+    /** Which channel generated notes go out on, and whether they carry MPE expression. */
+    enum class Routing
+    {
+        channelOne = 0,
+        perChannel,
+        mpe
+    };
 
     //==============================================================================
     BeatPeggiatorProcessor()
-        : AudioProcessor (BusesProperties().withInput  ("Input",  juce::AudioChannelSet::stereo(), true)
-                                           .withOutput ("Output", juce::AudioChannelSet::stereo(), true)),
+        : AudioProcessor (getBusesProperties()),
           parameters(*this, nullptr, "BeatPeggiator", createParameters())
     {
-        std::srand(std::time(NULL));
+        randomSeed = (uint32) Random::getSystemRandom().nextInt();
         
         numNotesParameter = parameters.getRawParameterValue("numNotes");
         beatDivisionParameter = parameters.getRawParameterValue("beatDivision");
         beatsParameter = parameters.getRawParameterValue("beats");
         
-
-        
+        for (auto& parameterID : getShapeParameterIDs())
+        {
+            parameters.addParameterListener(parameterID, this);
+        }
+    }
+    
+    ~BeatPeggiatorProcessor() override
+    {
+        for (auto& parameterID : getShapeParameterIDs())
+        {
+            parameters.removeParameterListener(parameterID, this);
+        }
     }
     //==============================================================================
     AudioProcessorValueTreeState::ParameterLayout createParameters()
@@ -178,51 +353,95 @@ public:
             numNotesParamCapture = new AudioParameterInt{"numNotes", "Number Of Notes", 1, 10, 1};
             beatDivisionParamCapture = new AudioParameterInt{"beatDivision", "Beat Division", 1, 10, 1};
             beatsParamCapture = new AudioParameterInt{"beats", "Beats", 1, 10, 1};
+            algorithmParamCapture = new AudioParameterChoice{"algorithm", "Algorithm", Rhythm::getAlgorithmNames(), 0};
+            rotationParamCapture = new AudioParameterInt{"rotation", "Rotation", 0, 9, 0};
+            probabilityParamCapture = new AudioParameterFloat{"probability", "Probability", NormalisableRange<float> (0.0f, 1.0f), 1.0f};
+            velocityRandomParamCapture = new AudioParameterFloat{"velocityRandom", "Velocity Random", NormalisableRange<float> (0.0f, 1.0f), 0.0f};
+            humanizeParamCapture = new AudioParameterInt{"humanize", "Humanize", 0, 2000, 0, "samples"};
+            ratchetsParamCapture = new AudioParameterInt{"ratchets", "Ratchets", 1, maxRatchets, 1};
+            ratchetDecayParamCapture = new AudioParameterFloat{"ratchetDecay", "Ratchet Decay", NormalisableRange<float> (0.0f, 1.0f), 0.25f};
+            routingParamCapture = new AudioParameterChoice{"routing", "Routing", StringArray { "Channel 1", "Per Channel", "MPE" }, 0};
+            midiClockParamCapture = new AudioParameterBool{"midiClock", "MIDI Clock Out", false};
             
             parameters.push_back (std::unique_ptr<AudioParameterInt>(numNotesParamCapture));
             parameters.push_back (std::unique_ptr<AudioParameterInt>(beatDivisionParamCapture));
             parameters.push_back (std::unique_ptr<AudioParameterInt>(beatsParamCapture));
+            parameters.push_back (std::unique_ptr<AudioParameterChoice>(algorithmParamCapture));
+            parameters.push_back (std::unique_ptr<AudioParameterInt>(rotationParamCapture));
+            parameters.push_back (std::unique_ptr<AudioParameterFloat>(probabilityParamCapture));
+            parameters.push_back (std::unique_ptr<AudioParameterFloat>(velocityRandomParamCapture));
+            parameters.push_back (std::unique_ptr<AudioParameterInt>(humanizeParamCapture));
+            parameters.push_back (std::unique_ptr<AudioParameterInt>(ratchetsParamCapture));
+            parameters.push_back (std::unique_ptr<AudioParameterFloat>(ratchetDecayParamCapture));
+            parameters.push_back (std::unique_ptr<AudioParameterChoice>(routingParamCapture));
+            parameters.push_back (std::unique_ptr<AudioParameterBool>(midiClockParamCapture));
                         
             return { parameters.begin(), parameters.end() };
         }
+    
+    /** The parameters getGeneratorSettings() reads. */
+    static StringArray getShapeParameterIDs()
+    {
+        return { "algorithm", "numNotes", "beatDivision", "rotation", "ratchets",
+                 "humanize", "probability", "velocityRandom", "ratchetDecay" };
+    }
+    
+    /** Read by the beat generator, possibly on its own thread; parameter values are atomic. */
+    BeatGenerator::Settings getGeneratorSettings() const
+    {
+        return { static_cast<Rhythm::Algorithm> (algorithmParamCapture->getIndex()),
+                 *numNotesParamCapture, *beatDivisionParamCapture, *rotationParamCapture,
+                 *ratchetsParamCapture, *humanizeParamCapture,
+                 *probabilityParamCapture, *velocityRandomParamCapture, *ratchetDecayParamCapture };
+    }
+    
 
-       
     //==============================================================================
-     void generateBeatMap(int numNotes, int beatDivision, std::vector<int> &beatMap)
+    /** Caps how many note-ons a single processBlock may emit; the rest are dropped
+        and counted. In MPE mode the expression restated with each note-on, and
+        expression passed through, come out of the same budget. Note-offs are
+        neither counted nor dropped. Takes effect on the next prepareToPlay.
+    */
+    void setMaxEventsPerBlock(int newMaximum)
     {
-        beatMap = std::vector<int>(beatDivision, 0);
-        
-         for (int i = 0; i < numNotes; i++)
-         {
-             int x = std::rand() % beatDivision;
-             while (beatMap[x] != 0)
-             {
-                 x = rand() % beatDivision;
-             }
-             beatMap[x] = 1;
-         }
+        maxEventsPerBlock = jlimit(1, maxEventsPerBlockLimit, newMaximum);
     }
-     
+    
+    int getMaxEventsPerBlock() const noexcept       { return maxEventsPerBlock; }
+    
+    /** Note-ons and expression events dropped by the event budget or a full
+        note-off queue, and clock ticks beyond the clock's reserve, since
+        prepareToPlay.
+    */
+    int getNumDroppedEvents() const noexcept        { return droppedEvents; }
+    
     //==============================================================================
-    void generateNoteDurations(int beatDivision)
+    /** Fixes the seed of the step generator, e.g. for reproducible offline renders.
+        The beat sequence restarts from this seed on the next prepareToPlay.
+    */
+    void setRandomSeed(uint32 newSeed)
     {
-        double offset = (double) 1 / beatDivision;
-        for (int i = 0; i < beatMap.size(); i++)
-        {
-            if (beatMap[i] == 1)
-            {
-                noteDurations.push_back(offset * i);
-            }
-        }
+        randomSeed = newSeed;
     }
     
+    /** Beats the audio thread had to generate because the lookahead didn't have them, since prepareToPlay. */
+    int getNumInlineBeats() const noexcept          { return generator.getNumInlineBeats(); }
+    
     //==============================================================================
-    void generateBeatPositions(AudioPlayHead::CurrentPositionInfo& info)
+   #if BEATPEGGIATOR_BENCHMARK
+    /** How long createParameters() and the AudioProcessorValueTreeState took to set up in the constructor. */
+    double getParameterSetupSeconds() const noexcept
     {
-        for (double duration : noteDurations)
-        {
-            beatPositions.push_back(std::ceil(info.ppqPosition) + duration);
-        }
+        return Time::highResolutionTicksToSeconds(parameterSetupTicks);
+    }
+   #endif
+    
+    /** Bytes this instance has allocated on top of sizeof (BeatPeggiatorProcessor), not counting
+        JUCE's parameter and state objects or the capture history.
+    */
+    size_t getAllocatedBytes() const noexcept
+    {
+        return outputMidiBytes + recorder.getAllocatedBytes() + patternSlot.getAllocatedBytes();
     }
     
     //==============================================================================
@@ -253,16 +472,14 @@ public:
     void Reset()
     {
         currentPosition = 0;
-        beatMap.clear();
-        noteDurations.clear();
-        beatPositions.clear();
+        timeline = nullptr;
         newBeat = true;
+        grid.resync();
     }
     //==============================================================================
     void prepareToPlay (double sampleRate, int samplesPerBlock) override
     {
         DBG("PREPARE");
-        ignoreUnused (samplesPerBlock);
 
         notes.clear();
 //        currentNote = 0;
@@ -272,26 +489,125 @@ public:
         newBeat = true;
         noteSent = false;
         rate = sampleRate;
+        timeline = nullptr;
+        grid.resync();
+        sampleClock = 0;
+        droppedEvents = 0;
+        
+        // hosts also prepare mid-session, e.g. for a new buffer size; notes still sounding
+        // downstream get their note-offs at the start of the next block
+        flushNoteOffs = numPendingNoteOffs > 0;
+        midiClock.prepare (sampleRate, samplesPerBlock);
+        
+        // the output buffer is sized for this budget, so the audio thread never sees a new one mid-play
+        eventBudget = maxEventsPerBlock;
+        outputMidiBytes = getOutputMidiBytes();
+        outputMidi.ensureSize (outputMidiBytes);
+        
+        // offline renders generate in line, so they never depend on the lookahead thread keeping up
+        generator.reset(randomSeed, ! isNonRealtime());
+        recorder.start();
 //        prevNumNotes = numNotes->get();
 //        prevBeatDivision = beatDivision->get();
     }
 
     void releaseResources() override {}
     
+    /** Hosts may bounce, or stop bouncing, without preparing again. */
+    void setNonRealtime (bool isNonRealtime) noexcept override
+    {
+        AudioProcessor::setNonRealtime (isNonRealtime);
+        generator.setRunInBackground (! isNonRealtime);
+    }
+    
+    /** Room for a full budget of events, a note-off for every note that was
+        pending or starts in the block, and the clock; a MIDI event takes a 4-byte
+        timestamp, a 2-byte size and up to 3 data bytes.
+    */
+    size_t getOutputMidiBytes() const noexcept
+    {
+        return (size_t) (2 * eventBudget + maxPendingNoteOffs + midiClock.getMaxEventsPerBlock()) * 9;
+    }
+    
     //==============================================================================
-    void sendNotes(MidiBuffer& midi, AudioPlayHead::CurrentPositionInfo& info, double numSamples)
+    void sendNotes(MidiBuffer& midi, AudioPlayHead::CurrentPositionInfo& info, int noteStart)
     {
-        int idx = notes.size() == 0 ? 0 : std::rand() % notes.size();
+        const auto routing = static_cast<Routing> (routingParamCapture->getIndex());
+        const int eventsNeeded = routing == Routing::mpe ? 4 : 1;
+        
+        if (eventsThisBlock + eventsNeeded > eventBudget || numPendingNoteOffs >= maxPendingNoteOffs)
+        {
+            droppedEvents++;
+            return;
+        }
+        
+        // every random value was drawn when the beat was generated; just read them back
+        int idx = jmin((int) (timeline->noteDraw[currentPosition] * notes.size()), notes.size() - 1);
 //        DBG("idx: " + std::to_string(idx));
-        int noteNumber = notes[idx];
-        MidiMessage noteOn = MidiMessage::noteOn(1, noteNumber, (uint8) 127);
-        MidiMessage noteOff = MidiMessage::noteOff(1, noteNumber);
+        const auto& held = notes[idx];
+        const int noteNumber = held.noteNumber;
+        const int channel = routing == Routing::channelOne ? 1 : held.channel;
+        
+        // the step's velocity scales the velocity the note was played with
+        const auto velocity = (uint8) jmax(1, held.velocity * timeline->velocity[currentPosition] / 127);
+        MidiMessage noteOn = MidiMessage::noteOn(channel, noteNumber, velocity);
+        
+        // a retrigger has to end the previous note before it starts again
+        sendNoteOffNow(midi, channel, noteNumber, sampleClock, noteStart);
+        
+        if (routing == Routing::mpe)
+        {
+            // restate the voice's expression so the new note starts where the held one is
+            midi.addEvent(MidiMessage::pitchWheel(channel, notes.getPitchBend(channel)), noteStart);
+            midi.addEvent(MidiMessage::channelPressureChange(channel, notes.getPressure(channel)), noteStart);
+            midi.addEvent(MidiMessage::controllerEvent(channel, 74, notes.getTimbre(channel)), noteStart);
+        }
         
-        // adjust note start to be in correct position
-        int noteStart = std::round(nextBeat * (rate * (double) 60.0/info.bpm)) - info.timeInSamples;
-
         midi.addEvent(noteOn, noteStart);
-        midi.addEvent(noteOff, 1000);
+        eventsThisBlock += eventsNeeded;
+        
+        const int length = jmax(1, (int) (timeline->length[currentPosition] * rate * 60.0 / info.bpm));
+        pendingNoteOffs[numPendingNoteOffs++] = { sampleClock + noteStart + length, channel, noteNumber };
+        
+        recorder.record({ nextBeat, length * info.bpm / (60.0 * rate), info.bpm, info.timeInSamples + noteStart,
+                          info.timeSigNumerator, info.timeSigDenominator,
+                          (uint8) channel, (uint8) noteNumber, velocity });
+    }
+    
+    //==============================================================================
+    /** Emits the pending note-off for this note early, if there is one. */
+    void sendNoteOffNow(MidiBuffer& midi, int channel, int noteNumber, int64 blockStart, int samplePosition)
+    {
+        for (int i = 0; i < numPendingNoteOffs; i++)
+        {
+            auto& pending = pendingNoteOffs[i];
+            
+            if (pending.channel == channel && pending.noteNumber == noteNumber)
+            {
+                const int position = (int) jlimit((int64) 0, (int64) samplePosition, pending.time - blockStart);
+                midi.addEvent(MidiMessage::noteOff(channel, noteNumber), position);
+
+                pendingNoteOffs[i] = pendingNoteOffs[--numPendingNoteOffs];
+                return;
+            }
+        }
+    }
+    
+    /** Emits every note-off that falls inside this block, or all of them when flushAll is set. */
+    void sendPendingNoteOffs(MidiBuffer& midi, int64 blockStart, int numSamples, bool flushAll)
+    {
+        for (int i = numPendingNoteOffs; --i >= 0;)
+        {
+            auto& pending = pendingNoteOffs[i];
+            
+            if (flushAll || pending.time < blockStart + numSamples)
+            {
+                const int position = flushAll ? 0 : (int) jmax((int64) 0, pending.time - blockStart);
+                midi.addEvent(MidiMessage::noteOff(pending.channel, pending.noteNumber), position);
+
+                pendingNoteOffs[i] = pendingNoteOffs[--numPendingNoteOffs];
+            }
+        }
     }
     
     //==============================================================================
@@ -303,12 +619,10 @@ public:
         tempo = info.bpm;
 //        jassert (buffer.getNumChannels() == 0);
         auto numSamples = buffer.getNumSamples();
-                
-        if (!info.isPlaying)
-        {
-            newBeat = true;
-        }
         
+        // keeps the lookahead on the beats the transport will play, even while nothing is held
+        generator.followTransport(info);
+                
 //        int numNotesValue = *numNotesParamCapture;
 //        int beatDivisionValue = *beatDivisionParamCapture;
 //        int beatsValue = *beatsParamCapture;
@@ -334,94 +648,224 @@ public:
         }
         
         
+        // events go into our own preallocated buffer, which is then swapped into the host's
+        outputMidi.clear();
+        eventsThisBlock = 0;
+        
+        if (flushNoteOffs)
+        {
+            sendPendingNoteOffs(outputMidi, sampleClock, numSamples, true);
+            flushNoteOffs = false;
+        }
+        
+        const bool isMpe = static_cast<Routing> (routingParamCapture->getIndex()) == Routing::mpe;
                                         
         for (const auto metadata : midi)
         {
             const auto msg = metadata.getMessage();
+            const int channel = msg.getChannel();
+            
+            if (channel == 0)
+            {
+                continue;
+            }
+            
             if (msg.isNoteOn())
             {
-                notes.add(msg.getNoteNumber());
+                notes.noteOn(channel, msg.getNoteNumber(), msg.getVelocity());
             }
-            if (msg.isNoteOff())
+            else if (msg.isNoteOff())
             {
-                notes.removeValue(msg.getNoteNumber());
+                notes.noteOff(channel, msg.getNoteNumber());
+            }
+            else if (msg.isAllNotesOff())
+            {
+                notes.allNotesOff(channel);
+            }
+            else if (msg.isPitchWheel() || msg.isChannelPressure() || (msg.isController() && msg.getControllerNumber() == 74))
+            {
+                if (msg.isPitchWheel())
+                    notes.setPitchBend(channel, msg.getPitchWheelValue());
+                else if (msg.isChannelPressure())
+                    notes.setPressure(channel, msg.getChannelPressureValue());
+                else
+                    notes.setTimbre(channel, msg.getControllerValue());
+                
+                // in MPE mode live expression keeps flowing to the generated voices
+                if (isMpe)
+                {
+                    if (eventsThisBlock < eventBudget)
+                    {
+                        outputMidi.addEvent(msg, metadata.samplePosition);
+                        eventsThisBlock++;
+                    }
+                    else
+                    {
+                        droppedEvents++;
+                    }
+                }
             }
         }
         
-        midi.clear();
+        // the clock follows the transport whether or not any notes are held
+        if (*midiClockParamCapture)
+        {
+            droppedEvents += midiClock.process(outputMidi, info, rate, numSamples);
+        }
+        else
+        {
+            midiClock.stop(outputMidi);
+        }
         
         if (!notes.isEmpty() && info.isPlaying)
+        {
+            renderSteps(outputMidi, info, numSamples);
+        }
+        else
+        {
+            grid.resync();
+        }
+        
+        sendPendingNoteOffs(outputMidi, sampleClock, numSamples, !info.isPlaying);
+        sampleClock += numSamples;
+        
+        // only with the fallback audio layout: input passes through, any extra outputs are silent
+        for (auto i = getTotalNumInputChannels(); i < getTotalNumOutputChannels(); ++i)
+        {
+            buffer.clear (i, 0, numSamples);
+        }
+        
+        // copied rather than swapped, so our preallocated storage never leaves us. The copy
+        // only allocates if the host's own buffer can't hold this block's events; JUCE's
+        // plugin wrappers size theirs up front
+        midi.clear();
+        midi.addEvents(outputMidi, 0, -1, 0);
+
+        if (notes.isEmpty())
+            {
+                Reset();
+            }
+        
+    }
+    
+    //==============================================================================
+    /** Where a step of the current beat lands, in ppq, once its humanize delay is applied. */
+    double getStepPosition(int step, double samplesPerBeat) const
+    {
+        // a delay of a whole slot or more would let hits overtake each other
+        const double maxDelay = jmin((double) timeline->humanize, samplesPerBeat * timeline->slotLength[step] - 1.0);
+        const int delay = jmax(0, (int) (timeline->timing[step] * maxDelay));
+        return beatStart + timeline->position[step] + delay / samplesPerBeat;
+    }
+    
+    /** Fires every step that falls inside this block. The BeatGrid maps the
+        block from its own ppqPosition and tempo alone, so where a step
+        lands doesn't depend on how the host splits its buffers, and one block
+        can cross any number of beat boundaries. When the block doesn't start
+        where the last one ended (transport start, loop jump, relocation), the
+        arp picks up part way through the beat the block starts in.
+    */
+    void renderSteps(MidiBuffer& midi, AudioPlayHead::CurrentPositionInfo& info, int numSamples)
+    {
+        const auto block = grid.next(info, rate, numSamples);
+        const double samplesPerBeat = block.samplesPerBeat;
+        
+        if (block.jumped)
+        {
+            // a step less than half a sample before the jump target still plays, at the first sample
+            beatStart = std::floor(block.start);
+            resumePosition = block.getEarliest();
+            newBeat = true;
+        }
+        
+        for (;;)
         {
             if (newBeat)
             {
+                if (beatStart >= block.end)
+                {
+                    return;
+                }
                 
-                beatMap.clear();
-                noteDurations.clear();
-                beatPositions.clear();
-                
-                generateBeatMap(*numNotesParamCapture, *beatDivisionParamCapture, beatMap);
-                generateNoteDurations(*beatDivisionParamCapture);
-                generateBeatPositions(info);
-                
+                // the beat was generated ahead of time; this only takes it over
+                timeline = &generator.nextBeat((int64) beatStart);
+                currentPosition = 0;
                 newBeat = false;
-                
             }
             
-            nextBeat = beatPositions[currentPosition];
-
-//            if (blockStart > nextBeat)
-//            {
-//                nextBeat = blockStart;
-//            }
-            
-            double blockStart = info.ppqPosition;
-            double blockEnd = (info.timeInSamples + numSamples) / (rate * ((double) 60.0/info.bpm));
-
-             while (nextBeat >= blockStart && nextBeat < blockEnd)
+            for (; currentPosition < timeline->numSteps; currentPosition++)
             {
+                nextBeat = getStepPosition(currentPosition, samplesPerBeat);
+                const int noteStart = block.getSample(nextBeat);
                 
-//                DBG("beatDivision: " + std::to_string(*beatDivision));
-//                DBG("blockStart: " + std::to_string(info.ppqPosition));
-//                DBG("nextBeat:" + std::to_string(nextBeat));
-//                DBG("blockEnd: " + std::to_string(blockEnd));
-//                DBG("--------------------");
-
-                sendNotes(midi, info, numSamples);
-                
-                if (*numNotesParamCapture == 1)
-                {
-                    newBeat = true;
-                    break;
-                }
-
-                if (currentPosition >= noteDurations.size() - 1)
+                if (noteStart >= numSamples)
                 {
-                    currentPosition = 0;
-                    newBeat = true;
-                    break;
+                    return;
                 }
-                else
+                
+                // steps before a jump target were never due; anything else that is late plays now
+                if (nextBeat >= resumePosition)
                 {
-                    currentPosition += 1;
-                    nextBeat = noteDurations[currentPosition];
+                    sendNotes(midi, info, jmax(0, noteStart));
                 }
             }
+            
+            beatStart += 1.0;
+            newBeat = true;
         }
-        
-        if (notes.isEmpty())
-            {
-                Reset();
-            }
-        
     }
 
     using AudioProcessor::processBlock;
 
     //==============================================================================
+    /** MIDI in, MIDI out and no audio at all, so hosts that honour the layout
+        don't allocate, route or clear audio buffers for each instance. AU loads
+        us as a MIDI FX, which never carries audio. The other formats also
+        declare a stereo input and output, disabled by default, for hosts that
+        won't insert a plugin without audio; see isBusesLayoutSupported().
+    */
+    static BusesProperties getBusesProperties()
+    {
+       #if JucePlugin_Build_AU || JucePlugin_Build_AUv3
+        // PluginHostType lives in the plugin client, which a console build of the harness leaves out
+        const auto wrapper = PluginHostType::getPluginLoadedAs();
+        
+        if (wrapper == wrapperType_AudioUnit || wrapper == wrapperType_AudioUnitv3)
+        {
+            return BusesProperties();
+        }
+       #endif
+        
+        return BusesProperties().withInput  ("Input",  juce::AudioChannelSet::stereo(), false)
+                                .withOutput ("Output", juce::AudioChannelSet::stereo(), false);
+    }
+    
+    /** MIDI-only is the preferred layout. A host that insists on audio gets a
+        mono or stereo output, which is silent, or passes matching input through
+        untouched.
+    */
+    bool isBusesLayoutSupported (const BusesLayout& layouts) const override
+    {
+        const auto input = layouts.getMainInputChannelSet();
+        const auto output = layouts.getMainOutputChannelSet();
+        
+        if (output.isDisabled())
+        {
+            return input.isDisabled();
+        }
+        
+        if (output != juce::AudioChannelSet::mono() && output != juce::AudioChannelSet::stereo())
+        {
+            return false;
+        }
+        
+        return input.isDisabled() || input == output;
+    }
+    
     bool isMidiEffect() const override                     { return true; }
 
     //==============================================================================
-    AudioProcessorEditor* createEditor() override          { return new BeatPeggiatorEditor (*this, parameters); }
+    AudioProcessorEditor* createEditor() override          { return new BeatPeggiatorEditor (*this, parameters, recorder, patternSlot); }
     bool hasEditor() const override                        { return true; }
 
     //==============================================================================
@@ -441,16 +885,20 @@ public:
 
     //==============================================================================
     
-//    void parameterChanged (const String& parameterID, float newValue) override
-//    {
-////        DBG("parameterChanged");
-////        DBG(parameterID + ": " + std::to_string(newValue));
-//    }
+    /** Any thread. Beats generated ahead of time with the old value are thrown away. */
+    void parameterChanged (const String& parameterID, float newValue) override
+    {
+//        DBG("parameterChanged");
+//        DBG(parameterID + ": " + std::to_string(newValue));
+        ignoreUnused(parameterID, newValue);
+        generator.settingsChanged();
+    }
     //==============================================================================
 
     void getStateInformation (MemoryBlock& destData) override
     {
         auto state = parameters.copyState();
+        state.setProperty ("pattern", patternSlot.getText(), nullptr);
         std::unique_ptr<juce::XmlElement> xml (state.createXml());
         copyXmlToBinary (*xml, destData);
     }
@@ -461,14 +909,25 @@ public:
  
         if (xmlState.get() != nullptr)
             if (xmlState->hasTagName (parameters.state.getType()))
+            {
                 parameters.replaceState (juce::ValueTree::fromXml (*xmlState));
+                // hosts restore state on any thread; the pattern is compiled on the message thread
+                patternSlot.setTextAsync (parameters.state.getProperty ("pattern").toString());
+            }
     }
     
 
 private:
     
    //==============================================================================
+   #if BEATPEGGIATOR_BENCHMARK
+    // these two bracket the parameter setup, since members are initialised in declaration order
+    int64 constructionStartTicks = Time::getHighResolutionTicks();
+    AudioProcessorValueTreeState parameters;
+    int64 parameterSetupTicks = Time::getHighResolutionTicks() - constructionStartTicks;
+   #else
     AudioProcessorValueTreeState parameters;
+   #endif
     std::atomic<float>* numNotesParameter = nullptr;
     std::atomic<float>* beatDivisionParameter = nullptr;
     std::atomic<float>* beatsParameter = nullptr;
@@ -476,6 +935,15 @@ private:
     AudioParameterInt* beatDivisionParamCapture;
     AudioParameterInt* numNotesParamCapture;
     AudioParameterInt* beatsParamCapture;
+    AudioParameterChoice* algorithmParamCapture;
+    AudioParameterInt* rotationParamCapture;
+    AudioParameterFloat* probabilityParamCapture;
+    AudioParameterFloat* velocityRandomParamCapture;
+    AudioParameterInt* humanizeParamCapture;
+    AudioParameterInt* ratchetsParamCapture;
+    AudioParameterFloat* ratchetDecayParamCapture;
+    AudioParameterChoice* routingParamCapture;
+    AudioParameterBool* midiClockParamCapture;
 //    AudioParameterInt* beatDivision;
 //    AudioParameterInt* numNotes;
     
@@ -483,17 +951,41 @@ private:
     int prevNumNotes, prevBeatDivision;
     int time;
     double rate;
-    SortedSet<int> notes;
+    HeldNotes notes;
+    PatternRecorder recorder;
+    PatternSlot patternSlot;
+    BeatGenerator generator { patternSlot, [this] { return getGeneratorSettings(); } };
+    MidiClock midiClock;
     int beats = 1;
     float tempo;
     double nextBeat;
+    double beatStart = 0;            // of the beat playing, or of the next one once newBeat is set
+    double resumePosition = 0;       // steps before this were skipped by the last jump
+    BeatGrid grid;
     int currentPosition;
     int noteStartTime;
     bool noteSent;
     bool newBeat;
-    std::vector<int> beatMap;
-    std::vector<double> noteDurations;
-    std::vector<double> beatPositions;
+    const StepTimeline* timeline = nullptr;     // the beat playing, owned by generator
+    
+    struct PendingNoteOff
+    {
+        int64 time;
+        int channel, noteNumber;
+    };
+    
+    uint32 randomSeed;
+    
+    int64 sampleClock = 0;           // samples processed since prepareToPlay; the host's position can jump
+    MidiBuffer outputMidi;
+    size_t outputMidiBytes = 0;
+    PendingNoteOff pendingNoteOffs[maxPendingNoteOffs];
+    int numPendingNoteOffs = 0;
+    bool flushNoteOffs = false;      // note-offs left over from before the last prepareToPlay
+    int eventsThisBlock = 0;
+    int eventBudget = 256;           // maxEventsPerBlock as of the last prepareToPlay
+    std::atomic<int> maxEventsPerBlock { 256 };
+    std::atomic<int> droppedEvents { 0 };
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BeatPeggiatorProcessor)
 };
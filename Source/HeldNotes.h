@@ -0,0 +1,120 @@
+/*
+  ==============================================================================
+
+    HeldNotes.h
+
+    The notes currently held on each input channel, plus each channel's
+    expression state (pitch bend, pressure and MPE timbre). Everything is stored
+    in flat fixed-size arrays indexed by channel and note, so note-on, note-off
+    and lookups stay O(1) with all 16 channels busy, and nothing allocates.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+class HeldNotes
+{
+public:
+    static constexpr int numChannels = 16;
+    static constexpr int numNoteNumbers = 128;
+    static constexpr int capacity = numChannels * numNoteNumbers;
+
+    struct Note
+    {
+        uint8 channel;      // 1-16
+        uint8 noteNumber;
+        uint8 velocity;
+    };
+
+    //==============================================================================
+    HeldNotes()
+    {
+        clear();
+    }
+
+    void clear() noexcept
+    {
+        std::fill (std::begin (slots), std::end (slots), (int16) -1);
+        numHeld = 0;
+
+        for (int i = 0; i < numChannels; ++i)
+        {
+            pitchBend[i] = 8192;
+            pressure[i] = 0;
+            timbre[i] = 64;
+        }
+    }
+
+    //==============================================================================
+    void noteOn (int channel, int noteNumber, uint8 velocity) noexcept
+    {
+        jassert (channel >= 1 && channel <= numChannels);
+        auto& slot = slots[getIndex (channel, noteNumber)];
+
+        if (slot < 0)
+        {
+            slot = (int16) numHeld;
+            held[numHeld++] = { (uint8) channel, (uint8) noteNumber, velocity };
+        }
+        else
+        {
+            held[slot].velocity = velocity;
+        }
+    }
+
+    void noteOff (int channel, int noteNumber) noexcept
+    {
+        jassert (channel >= 1 && channel <= numChannels);
+        auto& slot = slots[getIndex (channel, noteNumber)];
+
+        if (slot < 0)
+            return;
+
+        // move the last held note into the gap so the list stays dense
+        const auto& last = held[--numHeld];
+        held[slot] = last;
+        slots[getIndex (last.channel, last.noteNumber)] = slot;
+        slot = -1;
+    }
+
+    void allNotesOff (int channel) noexcept
+    {
+        for (int note = 0; note < numNoteNumbers; ++note)
+            noteOff (channel, note);
+    }
+
+    //==============================================================================
+    void setPitchBend (int channel, int value) noexcept     { pitchBend[channel - 1] = (int16) value; }
+    void setPressure (int channel, int value) noexcept      { pressure[channel - 1] = (uint8) value; }
+    void setTimbre (int channel, int value) noexcept        { timbre[channel - 1] = (uint8) value; }
+
+    int getPitchBend (int channel) const noexcept           { return pitchBend[channel - 1]; }
+    int getPressure (int channel) const noexcept            { return pressure[channel - 1]; }
+    int getTimbre (int channel) const noexcept              { return timbre[channel - 1]; }
+
+    //==============================================================================
+    bool isEmpty() const noexcept                           { return numHeld == 0; }
+    int size() const noexcept                               { return numHeld; }
+    const Note& operator[] (int index) const noexcept       { return held[index]; }
+
+    bool isHeld (int channel, int noteNumber) const noexcept
+    {
+        return slots[getIndex (channel, noteNumber)] >= 0;
+    }
+
+private:
+    static int getIndex (int channel, int noteNumber) noexcept
+    {
+        return (channel - 1) * numNoteNumbers + (noteNumber & 127);
+    }
+
+    int16 slots[capacity];      // position in held, or -1
+    Note held[capacity];
+    int numHeld = 0;
+
+    int16 pitchBend[numChannels];
+    uint8 pressure[numChannels];
+    uint8 timbre[numChannels];
+};
@@ -0,0 +1,409 @@
+/*
+  ==============================================================================
+
+    InstanceBenchmark.h
+
+    Measures what one BeatPeggiatorProcessor costs a host that loads a
+    template with hundreds of instances: constructing it (and within that,
+    createParameters() and the AudioProcessorValueTreeState), prepareToPlay,
+    opening and closing the editor, and destroying it. Checks the results
+    against the budget below.
+
+    Per-instance budget. The sizes are exact on any build and are enforced.
+    The times are targets for a release build; they depend on the machine
+    and the optimisation level, so they are only reported until a release
+    build against JUCE has recorded baselines to hold them to.
+
+        construction, including parameter setup    250 us
+        parameter setup alone                      150 us
+        prepareToPlay                              100 us
+        editor open + close                        10 ms
+        destruction                                250 us
+        sizeof (BeatPeggiatorProcessor)            40 KB
+        own buffers before prepareToPlay           0
+        own buffers once prepared                  64 KB
+
+    Where the plugin's own memory goes:
+
+        held notes (16 channels x 128 notes)        10 KB   in the object
+        lookahead timelines (6 beats)               19 KB   in the object
+        pending note-offs                            4 KB   in the object
+        capture FIFO                                48 KB   allocated in prepareToPlay
+        output MIDI buffer                           5 KB   allocated in prepareToPlay
+        pattern programs (3 buffers)                49 KB   allocated when a pattern is first set
+
+    The AudioProcessorValueTreeState, its 12 parameters and their ValueTree
+    are on the heap too, but JUCE owns them and they are not in the table.
+    Given a heap meter, run() measures the heap each phase leaves behind,
+    everything included; the console app passes one.
+
+    Instances share one background thread, which only starts when the first
+    instance is prepared, and the Euclidean and accent tables, which are
+    built at compile time.
+
+    compareLayouts() plays the same instances with the MIDI-only layout and
+    with the stereo fallback, and reports what the audio buses cost per
+    instance: processBlock time, the time the host spends zeroing the buffer
+    it hands over, each on its own, and, given a heap meter, the heap an
+    instance and its host buffers take. The sample bytes it also prints are
+    worked out from the channel count, not measured.
+
+    Not measured yet: the per-instance figures for both layouts have to come
+    from a release build against JUCE, with the heap meter, and be recorded
+    here. Until then, what the MIDI-only layout saves is a claim, not a result.
+
+    Nothing in the plugin includes this, and it needs the processor built with
+    BEATPEGGIATOR_BENCHMARK=1 so that it times its parameter setup. The console
+    app built by Tests/BeatPeggiatorTests.jucer runs both and fails if an
+    instance is over its memory budget.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "BeatPeggiatorProcessor.h"
+
+#if ! BEATPEGGIATOR_BENCHMARK
+ #error "InstanceBenchmark needs BEATPEGGIATOR_BENCHMARK=1"
+#endif
+
+class InstanceBenchmark
+{
+public:
+    //==============================================================================
+    struct Budget
+    {
+        static constexpr double constructionMicroseconds = 250.0;
+        static constexpr double parameterSetupMicroseconds = 150.0;
+        static constexpr double prepareMicroseconds = 100.0;
+        static constexpr double editorMicroseconds = 10000.0;
+        static constexpr double destructionMicroseconds = 250.0;
+        static constexpr size_t instanceBytes = 40 * 1024;
+        static constexpr size_t unpreparedAllocatedBytes = 0;
+        static constexpr size_t preparedAllocatedBytes = 64 * 1024;
+    };
+
+    /** Times are per instance, averaged over all instances. */
+    struct Result
+    {
+        int numInstances = 0;
+        double constructionMicroseconds = 0.0;
+        double parameterSetupMicroseconds = 0.0;
+        double prepareMicroseconds = 0.0;
+        double editorMicroseconds = 0.0;        // zero if the editor wasn't measured
+        double destructionMicroseconds = 0.0;
+        size_t instanceBytes = 0;
+        size_t unpreparedAllocatedBytes = 0;
+        size_t preparedAllocatedBytes = 0;
+        int64 constructedHeapBytes = -1;        // -1 without a heap meter
+        int64 preparedHeapBytes = -1;           // on top of constructedHeapBytes
+
+        /** The object and the plugin's own buffers; the same on every run, so safe to gate a build on. */
+        bool isWithinMemoryBudget() const
+        {
+            return instanceBytes <= Budget::instanceBytes
+                    && unpreparedAllocatedBytes <= Budget::unpreparedAllocatedBytes
+                    && preparedAllocatedBytes <= Budget::preparedAllocatedBytes;
+        }
+
+        /** Wall-clock times against the release targets; only meaningful on a release build. */
+        bool isWithinTimeBudget() const
+        {
+            return constructionMicroseconds <= Budget::constructionMicroseconds
+                    && parameterSetupMicroseconds <= Budget::parameterSetupMicroseconds
+                    && prepareMicroseconds <= Budget::prepareMicroseconds
+                    && editorMicroseconds <= Budget::editorMicroseconds
+                    && destructionMicroseconds <= Budget::destructionMicroseconds;
+        }
+
+        String toString() const
+        {
+            String text;
+            text << numInstances << " instances, per instance:" << newLine
+                 << "  construction     " << String (constructionMicroseconds, 1) << " us"
+                 << " (parameter setup " << String (parameterSetupMicroseconds, 1) << " us)" << newLine
+                 << "  prepareToPlay    " << String (prepareMicroseconds, 1) << " us" << newLine
+                 << "  editor           " << String (editorMicroseconds, 1) << " us" << newLine
+                 << "  destruction      " << String (destructionMicroseconds, 1) << " us" << newLine
+                 << "  object           " << (int) instanceBytes << " bytes" << newLine
+                 << "  own buffers      " << (int) unpreparedAllocatedBytes << " bytes before prepareToPlay, "
+                 << (int) preparedAllocatedBytes << " after" << newLine;
+
+            if (constructedHeapBytes >= 0)
+                text << "  heap             " << (int) constructedHeapBytes << " bytes after construction, "
+                     << (int) preparedHeapBytes << " more after prepareToPlay" << newLine;
+            else
+                text << "  heap             not measured" << newLine;
+
+            text << (isWithinMemoryBudget() ? "memory within budget" : "memory OVER BUDGET") << newLine
+                 << (isWithinTimeBudget() ? "times within the release targets" : "times over the release targets")
+                 << " (reported, not enforced)";
+            return text;
+        }
+    };
+
+    /** Processing cost of one bus layout. Times are per instance per block. */
+    struct LayoutResult
+    {
+        String name;
+        int numChannels = 0;
+        double processMicroseconds = 0.0;
+        double hostClearMicroseconds = 0.0;     // the host clearing the audio and MIDI buffers before processBlock
+        size_t audioBufferBytes = 0;            // computed: channels x block size x sizeof (float)
+        int64 heapBytes = -1;                   // measured: a prepared instance plus its host buffers, -1 without a heap meter
+    };
+
+    struct LayoutComparison
+    {
+        int numInstances = 0, blockSize = 0;
+        LayoutResult midiOnly, stereo;
+
+        double getMicrosecondsSaved() const     { return stereo.processMicroseconds - midiOnly.processMicroseconds; }
+        double getHostMicrosecondsSaved() const { return stereo.hostClearMicroseconds - midiOnly.hostClearMicroseconds; }
+        size_t getBytesSaved() const            { return stereo.audioBufferBytes - midiOnly.audioBufferBytes; }
+        int64 getHeapBytesSaved() const         { return stereo.heapBytes - midiOnly.heapBytes; }
+
+        String toString() const
+        {
+            String text;
+            text << numInstances << " instances playing " << blockSize << "-sample blocks, per instance per block:" << newLine;
+
+            for (auto* layout : { &midiOnly, &stereo })
+            {
+                text << "  " << layout->name.paddedRight (' ', 12)
+                     << String (layout->processMicroseconds, 3) << " us processBlock, "
+                     << String (layout->hostClearMicroseconds, 3) << " us host clearing, "
+                     << (int) layout->audioBufferBytes << " bytes of samples (computed), ";
+
+                if (layout->heapBytes >= 0)
+                    text << (int) layout->heapBytes << " bytes of heap" << newLine;
+                else
+                    text << "heap not measured" << newLine;
+            }
+
+            text << "  saved       " << String (getMicrosecondsSaved(), 3) << " us processBlock, "
+                 << String (getHostMicrosecondsSaved(), 3) << " us host clearing, "
+                 << (int) getBytesSaved() << " bytes of samples";
+
+            if (midiOnly.heapBytes >= 0 && stereo.heapBytes >= 0)
+                text << ", " << (int) getHeapBytesSaved() << " bytes of heap";
+
+            return text;
+        }
+    };
+
+    //==============================================================================
+    /** Returns the bytes the C runtime heap has handed out and not had back. */
+    using HeapMeter = int64 (*)();
+
+    /** Lets run() measure the heap, JUCE's objects included. The meter is
+        platform code, so the program running the benchmark supplies it.
+    */
+    static void setHeapMeter (HeapMeter meter) noexcept     { getHeapMeter() = meter; }
+
+    /** Builds numInstances processors side by side, the way a host loading a
+        template does, and times each phase across all of them. The editor
+        needs the message thread, so only set includeEditor when on it.
+    */
+    static Result run (int numInstances = 256, bool includeEditor = false,
+                       double sampleRate = 48000.0, int blockSize = 512)
+    {
+        Result result;
+        result.numInstances = numInstances;
+        result.instanceBytes = sizeof (BeatPeggiatorProcessor);
+
+        std::vector<std::unique_ptr<BeatPeggiatorProcessor>> instances;
+        instances.reserve ((size_t) numInstances);
+
+        // averaged, so objects the instances share, like the background thread, count a little each
+        auto* meter = getHeapMeter();
+        const int64 heapAtStart = meter != nullptr ? meter() : 0;
+
+        result.constructionMicroseconds = timePerInstance (numInstances, [&] (int)
+        {
+            instances.push_back (std::make_unique<BeatPeggiatorProcessor>());
+        });
+
+        const int64 heapConstructed = meter != nullptr ? meter() : 0;
+
+        for (auto& instance : instances)
+        {
+            result.parameterSetupMicroseconds += instance->getParameterSetupSeconds() * 1.0e6 / numInstances;
+            result.unpreparedAllocatedBytes = jmax (result.unpreparedAllocatedBytes, instance->getAllocatedBytes());
+        }
+
+        result.prepareMicroseconds = timePerInstance (numInstances, [&] (int i)
+        {
+            instances[(size_t) i]->setRateAndBufferSizeDetails (sampleRate, blockSize);
+            instances[(size_t) i]->prepareToPlay (sampleRate, blockSize);
+        });
+
+        for (auto& instance : instances)
+            result.preparedAllocatedBytes = jmax (result.preparedAllocatedBytes, instance->getAllocatedBytes());
+
+        if (meter != nullptr)
+        {
+            result.constructedHeapBytes = (heapConstructed - heapAtStart) / numInstances;
+            result.preparedHeapBytes = (meter() - heapConstructed) / numInstances;
+        }
+
+        if (includeEditor)
+        {
+            result.editorMicroseconds = timePerInstance (numInstances, [&] (int i)
+            {
+                std::unique_ptr<AudioProcessorEditor> editor (instances[(size_t) i]->createEditor());
+            });
+        }
+
+        result.destructionMicroseconds = timePerInstance (numInstances, [&] (int i)
+        {
+            instances[(size_t) i]->releaseResources();
+            instances[(size_t) i].reset();
+        });
+
+        return result;
+    }
+
+    /** Plays numInstances processors with a held chord for numBlocks blocks,
+        once with the MIDI-only layout and once with the stereo fallback, and
+        compares them. Like a host, it clears every instance's buffers, then runs
+        every instance for one block before moving on to the next.
+    */
+    static LayoutComparison compareLayouts (int numInstances = 256, int numBlocks = 1000,
+                                            double sampleRate = 48000.0, int blockSize = 512)
+    {
+        LayoutComparison comparison;
+        comparison.numInstances = numInstances;
+        comparison.blockSize = blockSize;
+        comparison.midiOnly = runLayout ("MIDI only", AudioChannelSet::disabled(), numInstances, numBlocks, sampleRate, blockSize);
+        comparison.stereo = runLayout ("stereo", AudioChannelSet::stereo(), numInstances, numBlocks, sampleRate, blockSize);
+        return comparison;
+    }
+
+private:
+    static HeapMeter& getHeapMeter() noexcept
+    {
+        static HeapMeter meter = nullptr;
+        return meter;
+    }
+
+    /** A transport that just plays on at a fixed tempo. */
+    struct PlayingTransport  : public AudioPlayHead
+    {
+        bool getCurrentPosition (CurrentPositionInfo& info) override
+        {
+            info.resetToDefault();
+            info.bpm = bpm;
+            info.isPlaying = true;
+            info.timeInSamples = position;
+            info.ppqPosition = position * bpm / (60.0 * sampleRate);
+            return true;
+        }
+
+        double sampleRate = 48000.0, bpm = 120.0;
+        int64 position = 0;
+    };
+
+    static LayoutResult runLayout (const String& name, const AudioChannelSet& channels, int numInstances,
+                                   int numBlocks, double sampleRate, int blockSize)
+    {
+        LayoutResult result;
+        result.name = name;
+
+        PlayingTransport transport;
+        transport.sampleRate = sampleRate;
+
+        std::vector<std::unique_ptr<BeatPeggiatorProcessor>> instances;
+        instances.reserve ((size_t) numInstances);
+        std::vector<AudioBuffer<float>> buffers ((size_t) numInstances);
+        std::vector<MidiBuffer> midi ((size_t) numInstances);
+
+        auto* meter = getHeapMeter();
+        const int64 heapAtStart = meter != nullptr ? meter() : 0;
+
+        for (int i = 0; i < numInstances; ++i)
+        {
+            auto instance = std::make_unique<BeatPeggiatorProcessor>();
+
+            auto layout = instance->getBusesLayout();
+            for (auto& bus : layout.inputBuses)
+                bus = channels;
+            for (auto& bus : layout.outputBuses)
+                bus = channels;
+
+            const bool applied = instance->setBusesLayout (layout);
+            jassert (applied);
+            ignoreUnused (applied);
+
+            instance->setPlayHead (&transport);
+            instance->setRateAndBufferSizeDetails (sampleRate, blockSize);
+            instance->prepareToPlay (sampleRate, blockSize);
+
+            // sized the way a host would for this layout
+            const int numChannels = jmax (instance->getTotalNumInputChannels(), instance->getTotalNumOutputChannels());
+            buffers[(size_t) i].setSize (numChannels, blockSize);
+            midi[(size_t) i].ensureSize (4096);
+
+            result.numChannels = numChannels;
+            result.audioBufferBytes = (size_t) numChannels * (size_t) blockSize * sizeof (float);
+            instances.push_back (std::move (instance));
+        }
+
+        if (meter != nullptr)
+            result.heapBytes = (meter() - heapAtStart) / jmax (1, numInstances);
+
+        // the host's share is timed on its own, so processBlock is measured without it
+        int64 hostTicks = 0, processTicks = 0;
+
+        for (int block = 0; block < numBlocks; ++block)
+        {
+            auto start = Time::getHighResolutionTicks();
+
+            for (int i = 0; i < numInstances; ++i)
+            {
+                auto& events = midi[(size_t) i];
+                events.clear();
+
+                if (block == 0)
+                {
+                    events.addEvent (MidiMessage::noteOn (1, 60, (uint8) 100), 0);
+                    events.addEvent (MidiMessage::noteOn (1, 64, (uint8) 100), 0);
+                    events.addEvent (MidiMessage::noteOn (1, 67, (uint8) 100), 0);
+                }
+
+                buffers[(size_t) i].clear();
+            }
+
+            auto processStart = Time::getHighResolutionTicks();
+            hostTicks += processStart - start;
+
+            for (int i = 0; i < numInstances; ++i)
+                instances[(size_t) i]->processBlock (buffers[(size_t) i], midi[(size_t) i]);
+
+            processTicks += Time::getHighResolutionTicks() - processStart;
+            transport.position += blockSize;
+        }
+
+        const double numCalls = (double) jmax (1, numInstances) * jmax (1, numBlocks);
+        result.processMicroseconds = Time::highResolutionTicksToSeconds (processTicks) * 1.0e6 / numCalls;
+        result.hostClearMicroseconds = Time::highResolutionTicksToSeconds (hostTicks) * 1.0e6 / numCalls;
+
+        for (auto& instance : instances)
+            instance->releaseResources();
+
+        return result;
+    }
+
+    template <typename Function>
+    static double timePerInstance (int numInstances, Function&& function)
+    {
+        const auto start = Time::getHighResolutionTicks();
+
+        for (int i = 0; i < numInstances; ++i)
+            function (i);
+
+        const auto elapsed = Time::getHighResolutionTicks() - start;
+        return Time::highResolutionTicksToSeconds (elapsed) * 1.0e6 / jmax (1, numInstances);
+    }
+};
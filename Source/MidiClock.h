@@ -0,0 +1,158 @@
+/*
+  ==============================================================================
+
+    MidiClock.h
+
+    MIDI clock (24 ticks per quarter note) and start/stop/continue for
+    downstream gear, following the host transport. Each block is mapped onto
+    the tick grid by the same BeatGrid the arp maps its steps with, so the
+    clock stays in phase across block boundaries, tempo changes and loop
+    jumps. Placing the first tick costs one multiply; every
+    tick after it is one add.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "BeatGrid.h"
+
+class MidiClock
+{
+public:
+    static constexpr int ticksPerBeat = 24;
+    static constexpr int ticksPerSixteenth = 6;         // song position pointer counts sixteenths
+    static constexpr int maxSongPosition = 16383;
+
+    /** The fastest tempo the event reserve is sized for. Faster, ticks that
+        don't fit are dropped, and the clock stays in phase without them.
+    */
+    static constexpr double maxTempo = 999.0;
+
+    //==============================================================================
+    /** Sizes the event reserve for blocks of up to samplesPerBlock, and resyncs
+        on the next block. Call from prepareToPlay. Hosts also prepare mid-session,
+        e.g. for a new buffer size, so receivers that are still running stay
+        marked as running and get a Stop before the clock starts again.
+    */
+    void prepare (double sampleRate, int samplesPerBlock) noexcept
+    {
+        const double samplesPerTick = sampleRate * 60.0 / (maxTempo * ticksPerBeat);
+
+        // a tick at each end of the block, plus a stop, song position and continue
+        maxEventsPerBlock = (int) std::ceil (samplesPerBlock / samplesPerTick) + 1 + 3;
+        startPending = false;
+        grid.resync();
+    }
+
+    /** Events a block can add at most, as of the last prepare(). */
+    int getMaxEventsPerBlock() const noexcept       { return maxEventsPerBlock; }
+
+    /** Forgets the transport. The next block that plays starts the clock afresh. */
+    void reset() noexcept
+    {
+        isRunning = false;
+        startPending = false;
+        grid.resync();
+    }
+
+    /** Adds this block's clock to midi. Receivers are stopped when the transport
+        stops or jumps, and started again on the next sixteenth: with Start if
+        that is the top of the song, otherwise with a song position pointer and
+        Continue, each at the sample of the first tick that follows it.
+        Returns the ticks dropped because the block was longer, or the tempo
+        faster, than the reserve allows.
+    */
+    int process (MidiBuffer& midi, const AudioPlayHead::CurrentPositionInfo& info, double sampleRate, int numSamples)
+    {
+        if (! info.isPlaying)
+        {
+            stop (midi);
+            return 0;
+        }
+
+        int numEvents = 0;
+        int numDropped = 0;
+
+        const auto block = grid.next (info, sampleRate, numSamples);
+        const double samplesPerTick = block.samplesPerBeat / ticksPerBeat;
+        const double blockStartTick = block.start * ticksPerBeat;
+
+        if (block.jumped)
+        {
+            numEvents += sendStop (midi);
+
+            const double earliestTick = jmax (0.0, block.getEarliest()) * ticksPerBeat;
+            nextTick = (int64) std::ceil (earliestTick / ticksPerSixteenth) * ticksPerSixteenth;
+            startPending = true;
+        }
+
+        for (double offset = ((double) nextTick - blockStartTick) * samplesPerTick;; offset += samplesPerTick)
+        {
+            const int sample = jmax (0, roundToInt (offset));
+
+            if (sample >= numSamples)
+            {
+                return numDropped;
+            }
+
+            if (startPending)
+            {
+                if (nextTick == 0)
+                {
+                    midi.addEvent (MidiMessage::midiStart(), sample);
+                }
+                else
+                {
+                    const int sixteenth = (int) jmin ((int64) maxSongPosition, nextTick / ticksPerSixteenth);
+                    midi.addEvent (MidiMessage::songPositionPointer (sixteenth), sample);
+                    midi.addEvent (MidiMessage::midiContinue(), sample);
+                    numEvents++;
+                }
+
+                numEvents++;
+                startPending = false;
+                isRunning = true;
+            }
+
+            if (numEvents < maxEventsPerBlock)
+            {
+                midi.addEvent (MidiMessage::midiClock(), sample);
+                numEvents++;
+            }
+            else
+            {
+                numDropped++;
+            }
+
+            ++nextTick;
+        }
+    }
+
+    /** Stops receivers at the start of the block if they are running. Returns
+        the events added.
+    */
+    int stop (MidiBuffer& midi)
+    {
+        const int numEvents = sendStop (midi);
+        reset();
+        return numEvents;
+    }
+
+private:
+    int sendStop (MidiBuffer& midi)
+    {
+        if (! isRunning)
+            return 0;
+
+        midi.addEvent (MidiMessage::midiStop(), 0);
+        isRunning = false;
+        return 1;
+    }
+
+    BeatGrid grid;
+    int64 nextTick = 0;              // the next tick to send, counted from ppq 0
+    bool isRunning = false;          // receivers have had Start or Continue, and no Stop since
+    bool startPending = false;       // Start or Continue goes out with the next tick
+    int maxEventsPerBlock = 0;
+};
@@ -0,0 +1,644 @@
+/*
+  ==============================================================================
+
+    OfflineHarness.h
+
+    Renders a seeded scenario through BeatPeggiatorProcessor the way a host
+    would: held notes, parameter values and a scripted transport with tempo
+    changes, loop jumps and stop/start. It renders the scenario once per
+    buffer layout (fixed, random and single-sample blocks) and checks every
+    render against a reference built from the script alone: the transport's
+    ppq-to-sample map and the step positions the scenario expects, so the
+    plugin's output never defines what is right. Each render is also checked
+    for playing the same notes as the first. With the midiClock parameter on,
+    it does the same for the clock ticks, and checks that Start and Continue
+    put receivers where the ticks say.
+
+    Nothing in the plugin includes this. Tests/BeatPeggiatorTests.jucer builds
+    a console app that runs OfflineHarness::runStressTest() and fails if it
+    does.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include <map>
+#include <tuple>
+#include "BeatPeggiatorProcessor.h"
+
+class OfflineHarness
+{
+public:
+    //==============================================================================
+    struct TempoChange
+    {
+        int64 sample;
+        double bpm;
+    };
+
+    struct StoppedSpan
+    {
+        int64 start, end;
+    };
+
+    /** Sample positions are counted from the start of the render. expectedSteps
+        is written by hand from the parameters: where in every beat a step
+        fires. With humanize at zero and probability at one, each of them
+        plays notesPerStep note-ons wherever the transport is playing.
+    */
+    struct Scenario
+    {
+        double sampleRate = 48000.0;
+        int64 lengthInSamples = 0;
+        uint32 seed = 1;
+        double bpm = 120.0;
+        std::vector<TempoChange> tempoChanges;      // sorted by sample
+        double loopStart = 0.0, loopEnd = 0.0;      // in ppq; looping is off unless loopEnd > loopStart
+        std::vector<StoppedSpan> stops;             // sorted and non-overlapping
+        std::vector<int> heldNotes;                 // held on channel 1 from the first sample
+        std::vector<std::pair<String, float>> parameters;   // parameter ID and value in its own range
+        std::vector<double> expectedSteps;          // within the beat, in beats, sorted
+        int notesPerStep = 1;
+    };
+
+    enum class BlockSizes
+    {
+        fixed,
+        random,         // uniform between 1 and blockSize
+        single
+    };
+
+    struct Layout
+    {
+        BlockSizes sizes;
+        int blockSize;
+
+        String getName() const
+        {
+            switch (sizes)
+            {
+                case BlockSizes::random:    return "random 1-" + String (blockSize);
+                case BlockSizes::single:    return "single sample";
+                case BlockSizes::fixed:
+                default:                    return "fixed " + String (blockSize);
+            }
+        }
+    };
+
+    struct Report
+    {
+        String layout;
+        int numNoteOns = 0;
+        double maxTimingError = 0.0;    // samples away from the nearest expected step
+        double meanTimingError = 0.0;
+        int numMissing = 0;             // expected note-ons this render lacks
+        int numDuplicated = 0;          // the other way round, plus note-ons of a note already sounding
+        int numMismatched = 0;          // note-ons with another channel or note number than in the first render
+        int numStuck = 0;               // notes still sounding once the transport has stopped at the end
+
+        int numClockTicks = 0;
+        double maxClockJitter = 0.0;    // samples away from the nearest expected tick
+        double meanClockJitter = 0.0;
+        int numClockMissing = 0;        // against the expected ticks, as for note-ons
+        int numClockDuplicated = 0;
+        int numClockOutOfPhase = 0;     // ticks while receivers are stopped, or not where Start or Continue put them
+        bool stoppedAtEnd = true;       // receivers got a Stop once the transport stopped at the end
+
+        /** Rounding to whole samples alone costs up to half a sample. */
+        bool passed (double timingToleranceInSamples = 1.0) const
+        {
+            return maxTimingError <= timingToleranceInSamples
+                    && numMissing == 0 && numDuplicated == 0 && numMismatched == 0 && numStuck == 0
+                    && maxClockJitter <= timingToleranceInSamples
+                    && numClockMissing == 0 && numClockDuplicated == 0 && numClockOutOfPhase == 0
+                    && stoppedAtEnd;
+        }
+
+        String toString() const
+        {
+            auto text = layout + ": " + String (numNoteOns) + " note-ons, timing error max "
+                          + String (maxTimingError, 2) + " / mean " + String (meanTimingError, 2) + " samples, "
+                          + String (numMissing) + " missing, " + String (numDuplicated) + " duplicated, "
+                          + String (numMismatched) + " mismatched, " + String (numStuck) + " stuck";
+
+            if (numClockTicks > 0)
+                text += "; " + String (numClockTicks) + " clock ticks, jitter max "
+                          + String (maxClockJitter, 2) + " / mean " + String (meanClockJitter, 2) + " samples, "
+                          + String (numClockMissing) + " missing, " + String (numClockDuplicated) + " duplicated, "
+                          + String (numClockOutOfPhase) + " out of phase" + (stoppedAtEnd ? "" : ", not stopped");
+
+            return text;
+        }
+    };
+
+    //==============================================================================
+    /** Renders the scenario with each layout and checks it against the
+        expected events. Which of the held notes each step plays is the
+        plugin's choice, so that is only checked against the first layout.
+    */
+    static std::vector<Report> run (const Scenario& scenario, const std::vector<Layout>& layouts)
+    {
+        std::vector<Report> reports;
+        const auto expected = getExpected (scenario);
+        std::map<NoteKey, int> firstNoteOns;
+
+        for (auto& layout : layouts)
+        {
+            Report report;
+            report.layout = layout.getName();
+
+            const auto events = render (scenario, layout, report);
+
+            match (expected.noteOns, events.noteOnSamples, report.maxTimingError, report.meanTimingError,
+                   report.numMissing, report.numDuplicated);
+            match (expected.clockTicks, events.clockTickSamples, report.maxClockJitter, report.meanClockJitter,
+                   report.numClockMissing, report.numClockDuplicated);
+
+            if (reports.empty())
+                firstNoteOns = events.noteOns;
+
+            report.numMismatched = countMismatched (firstNoteOns, events.noteOns);
+            reports.push_back (report);
+        }
+
+        return reports;
+    }
+
+    static std::vector<Layout> getDefaultLayouts()
+    {
+        return { { BlockSizes::fixed, 512 },
+                 { BlockSizes::fixed, 100 },
+                 { BlockSizes::random, 2048 },
+                 { BlockSizes::single, 1 } };
+    }
+
+    /** Three tempo changes, a loop whose end isn't on a beat, and two stops.
+        The loop starts a fraction of a sample past beat 8, as it would with
+        loop points set in samples, so every pass has to keep the downbeat.
+    */
+    static Scenario createStressScenario()
+    {
+        Scenario scenario;
+        const double sr = scenario.sampleRate;
+
+        scenario.lengthInSamples = (int64) (16 * sr);
+        scenario.seed = 20211;
+        scenario.tempoChanges = { { (int64) (3.0 * sr), 97.3 },
+                                  { (int64) (7.0 * sr), 143.0 },
+                                  { (int64) (11.5 * sr), 120.0 } };
+        scenario.loopStart = 8.00001;
+        scenario.loopEnd = 14.5;
+        scenario.stops = { { (int64) (5.0 * sr), (int64) (5.6 * sr) },
+                           { (int64) (13.0 * sr), (int64) (13.25 * sr) } };
+        scenario.heldNotes = { 60, 64, 67 };
+        scenario.parameters = { { "numNotes", 3.0f },
+                                { "beatDivision", 4.0f },
+                                { "ratchets", 2.0f },
+                                { "algorithm", (float) Rhythm::Algorithm::euclidean },
+                                { "midiClock", 1.0f } };
+
+        // E(3,4) is x.xx, and each of its steps splits into two ratchets
+        scenario.expectedSteps = { 0.0, 0.125, 0.5, 0.625, 0.75, 0.875 };
+        return scenario;
+    }
+
+    /** Runs the stress scenario with the default layouts and describes the result. */
+    static String runStressTest()
+    {
+        String text;
+        bool allPassed = true;
+
+        for (auto& report : run (createStressScenario(), getDefaultLayouts()))
+        {
+            text << report.toString() << newLine;
+            allPassed = allPassed && report.passed();
+        }
+
+        return text + (allPassed ? "PASSED" : "FAILED");
+    }
+
+private:
+    //==============================================================================
+    using NoteKey = std::tuple<int64, int, int>;    // sample, channel, note number
+    using ExpectedEvents = std::vector<std::pair<double, int>>;     // ideal sample and count, in order
+
+    struct Expected
+    {
+        ExpectedEvents noteOns, clockTicks;
+    };
+
+    struct Events
+    {
+        std::map<NoteKey, int> noteOns;
+        std::vector<int64> noteOnSamples, clockTickSamples;
+    };
+
+    /** The host side of the script. Positions follow the script in render time,
+        so every layout sees exactly the same transport at the same sample.
+    */
+    class Transport  : public AudioPlayHead
+    {
+    public:
+        explicit Transport (const Scenario& s)
+            : scenario (s),
+              bpm (s.bpm)
+        {
+        }
+
+        /** Called at the start of every block. Applies any script event at
+            sample t and returns how many samples can be rendered before the
+            next one. Positions are only re-anchored at events.
+        */
+        int64 advanceTo (int64 t)
+        {
+            bool shouldPlay = true;
+
+            for (auto& stop : scenario.stops)
+                if (t >= stop.start && t < stop.end)
+                    shouldPlay = false;
+
+            for (auto& change : scenario.tempoChanges)
+            {
+                if (change.sample == t)
+                {
+                    moveAnchor (t);
+                    bpm = change.bpm;
+                }
+            }
+
+            if (shouldPlay != isPlaying)
+            {
+                moveAnchor (t);
+                isPlaying = shouldPlay;
+            }
+
+            // like a host, resume at exactly the loop start, whatever the last block overshot the end by
+            if (isPlaying && isLooping() && t >= getLoopEndSample())
+            {
+                moveAnchor (t);
+                anchorSongSample -= roundToInt ((anchorPpq - scenario.loopStart) * getSamplesPerBeat());
+                anchorPpq = scenario.loopStart;
+            }
+
+            int64 next = scenario.lengthInSamples;
+
+            for (auto& change : scenario.tempoChanges)
+                if (change.sample > t)
+                    next = jmin (next, change.sample);
+
+            for (auto& stop : scenario.stops)
+            {
+                if (stop.start > t)     next = jmin (next, stop.start);
+                if (stop.end > t)       next = jmin (next, stop.end);
+            }
+
+            if (isPlaying && isLooping())
+                next = jmin (next, jmax (t + 1, getLoopEndSample()));
+
+            return next - t;
+        }
+
+        void stop (int64 t)
+        {
+            moveAnchor (t);
+            isPlaying = false;
+        }
+
+        double getPpq (int64 t) const
+        {
+            return isPlaying ? anchorPpq + (t - anchorSample) / getSamplesPerBeat() : anchorPpq;
+        }
+
+        double getSamplesPerBeat() const        { return scenario.sampleRate * 60.0 / bpm; }
+        bool isRunning() const                  { return isPlaying; }
+
+        void setPosition (int64 t)              { now = t; }
+
+        bool getCurrentPosition (CurrentPositionInfo& info) override
+        {
+            info.resetToDefault();
+            info.bpm = bpm;
+            info.timeSigNumerator = 4;
+            info.timeSigDenominator = 4;
+            info.ppqPosition = getPpq (now);
+            info.timeInSamples = anchorSongSample + (isPlaying ? now - anchorSample : 0);
+            info.timeInSeconds = info.timeInSamples / scenario.sampleRate;
+            info.isPlaying = isPlaying;
+            info.isLooping = isLooping();
+            info.ppqLoopStart = scenario.loopStart;
+            info.ppqLoopEnd = scenario.loopEnd;
+            return true;
+        }
+
+    private:
+        bool isLooping() const                  { return scenario.loopEnd > scenario.loopStart; }
+
+        /** The first sample at or past the loop end, worked out from the last
+            anchor only, so it can't depend on where the blocks fall.
+        */
+        int64 getLoopEndSample() const
+        {
+            return anchorSample + (int64) std::ceil ((scenario.loopEnd - anchorPpq) * getSamplesPerBeat());
+        }
+
+        void moveAnchor (int64 t)
+        {
+            // like a host's, the sample position runs on through tempo changes
+            // and jumps back at the loop, so it drifts away from ppq * samplesPerBeat
+            anchorPpq = getPpq (t);
+            anchorSongSample += isPlaying ? t - anchorSample : 0;
+            anchorSample = t;
+        }
+
+        const Scenario& scenario;
+        double bpm;
+        bool isPlaying = true;
+        int64 now = 0, anchorSample = 0, anchorSongSample = 0;
+        double anchorPpq = 0.0;
+    };
+
+    //==============================================================================
+    /** Where note-ons and clock ticks belong, worked out from the script alone:
+        the transport's ppq-to-sample map, one stretch between script events at
+        a time, and the steps the scenario expects in every beat. Each event
+        belongs to the stretch its ideal sample rounds into, so one less than
+        half a sample before a jump target still plays and one that close to
+        the end of a stretch before a jump doesn't. After a start, stop or loop
+        jump, steps resume from the new position and the clock on the next
+        sixteenth; across a tempo change both carry straight on.
+    */
+    static Expected getExpected (const Scenario& scenario)
+    {
+        Expected expected;
+        Transport transport (scenario);
+        const bool hasClock = getParameterValue (scenario, "midiClock") > 0.5f;
+        bool wasPlaying = false;
+        double previousEndPpq = 0.0;
+
+        for (int64 t = 0; t < scenario.lengthInSamples;)
+        {
+            const int64 end = t + transport.advanceTo (t);
+            const double startPpq = transport.getPpq (t);
+            const double endPpq = transport.getPpq (end);
+            const double samplesPerBeat = transport.getSamplesPerBeat();
+
+            auto getSample = [&] (double ppq) { return (double) t + (ppq - startPpq) * samplesPerBeat; };
+
+            if (transport.isRunning())
+            {
+                for (double beat = std::floor (startPpq - 1.0 / samplesPerBeat); beat < endPpq; beat += 1.0)
+                {
+                    for (double step : scenario.expectedSteps)
+                    {
+                        const double sample = getSample (beat + step);
+
+                        if (sample >= (double) t - 0.5 && sample < (double) end - 0.5)
+                            expected.noteOns.push_back ({ sample, scenario.notesPerStep });
+                    }
+                }
+
+                if (hasClock)
+                {
+                    // a tick that rounds onto the first sample of the stretch belongs to it
+                    const double earliestTick = jmax (0.0, (startPpq - 0.5 / samplesPerBeat) * MidiClock::ticksPerBeat);
+                    const bool carriesOn = wasPlaying && std::abs (startPpq - previousEndPpq) * samplesPerBeat <= 1.0;
+                    const int64 firstTick = carriesOn ? (int64) std::ceil (earliestTick)
+                                                      : (int64) std::ceil (earliestTick / MidiClock::ticksPerSixteenth)
+                                                            * MidiClock::ticksPerSixteenth;
+
+                    for (int64 tick = firstTick;; ++tick)
+                    {
+                        const double sample = getSample ((double) tick / MidiClock::ticksPerBeat);
+
+                        if (sample >= (double) end - 0.5)
+                            break;
+
+                        expected.clockTicks.push_back ({ sample, 1 });
+                    }
+                }
+            }
+
+            wasPlaying = transport.isRunning();
+            previousEndPpq = endPpq;
+            t = end;
+        }
+
+        return expected;
+    }
+
+    static Events render (const Scenario& scenario, const Layout& layout, Report& report)
+    {
+        const int maxBlockSize = layout.sizes == BlockSizes::single ? 1 : layout.blockSize;
+
+        BeatPeggiatorProcessor processor;
+        Transport transport (scenario);
+
+        processor.setNonRealtime (true);
+        processor.setRandomSeed (scenario.seed);
+        processor.setPlayHead (&transport);
+        processor.setRateAndBufferSizeDetails (scenario.sampleRate, maxBlockSize);
+        applyParameters (processor, scenario);
+        processor.prepareToPlay (scenario.sampleRate, maxBlockSize);
+
+        const int numChannels = jmax (processor.getTotalNumInputChannels(), processor.getTotalNumOutputChannels());
+        AudioBuffer<float> buffer (numChannels, maxBlockSize);
+        MidiBuffer midi;
+        Random random ((int64) scenario.seed);
+
+        Events events;
+        bool sounding[16][128] = {};
+        bool clockRunning = false;
+        int64 expectedTick = -1;        // where receivers are, or -1 if nothing has told them
+        int64 songPositionTick = 0;
+        int64 t = 0;
+
+        auto processBlock = [&] (int numSamples)
+        {
+            transport.setPosition (t);
+            const double blockPpq = transport.getPpq (t);
+            const double samplesPerBeat = transport.getSamplesPerBeat();
+            const int64 blockStart = t;
+
+            buffer.setSize (numChannels, numSamples, false, false, true);
+            buffer.clear();
+            processor.processBlock (buffer, midi);
+
+            for (const auto metadata : midi)
+            {
+                const auto msg = metadata.getMessage();
+
+                if (msg.isMidiClock() || msg.isMidiStart() || msg.isMidiContinue()
+                     || msg.isMidiStop() || msg.isSongPositionPointer())
+                {
+                    const double ppq = blockPpq + metadata.samplePosition / samplesPerBeat;
+                    checkClock (msg, blockStart + metadata.samplePosition, ppq,
+                                clockRunning, expectedTick, songPositionTick, events, report);
+                    continue;
+                }
+
+                auto& isSounding = sounding[(msg.getChannel() - 1) & 15][msg.getNoteNumber() & 127];
+
+                if (msg.isNoteOn())
+                {
+                    const int64 sample = blockStart + metadata.samplePosition;
+
+                    report.numNoteOns++;
+
+                    if (isSounding)
+                        report.numDuplicated++;
+
+                    isSounding = true;
+                    events.noteOnSamples.push_back (sample);
+                    events.noteOns[NoteKey { sample, msg.getChannel(), msg.getNoteNumber() }]++;
+                }
+                else if (msg.isNoteOff())
+                {
+                    isSounding = false;
+                }
+            }
+
+            midi.clear();
+            t += numSamples;
+        };
+
+        for (int note : scenario.heldNotes)
+            midi.addEvent (MidiMessage::noteOn (1, note, (uint8) 100), 0);
+
+        while (t < scenario.lengthInSamples)
+        {
+            const int64 untilNextEvent = transport.advanceTo (t);
+            int numSamples = maxBlockSize;
+
+            if (layout.sizes == BlockSizes::random)
+                numSamples = 1 + random.nextInt (maxBlockSize);
+
+            processBlock ((int) jmin ((int64) numSamples, untilNextEvent));
+        }
+
+        // stopping has to silence everything that is still sounding, and stop the clock
+        transport.stop (t);
+        processBlock (1);
+
+        for (auto& channel : sounding)
+            for (bool isSounding : channel)
+                report.numStuck += isSounding ? 1 : 0;
+
+        report.stoppedAtEnd = ! clockRunning;
+        return events;
+    }
+
+    /** Follows the clock the way a receiver would. A tick has to be the one
+        receivers expect: the song position after Start or Continue, then one
+        more each time. Its timing is checked against the expected ticks later.
+    */
+    static void checkClock (const MidiMessage& msg, int64 sample, double ppq, bool& running, int64& expectedTick,
+                            int64& songPositionTick, Events& events, Report& report)
+    {
+        if (msg.isSongPositionPointer())
+        {
+            const auto* data = msg.getRawData();
+            songPositionTick = (data[1] | (data[2] << 7)) * (int64) MidiClock::ticksPerSixteenth;
+        }
+        else if (msg.isMidiStart() || msg.isMidiContinue())
+        {
+            report.numClockOutOfPhase += running ? 1 : 0;
+            expectedTick = msg.isMidiStart() ? 0 : songPositionTick;
+            running = true;
+        }
+        else if (msg.isMidiStop())
+        {
+            running = false;
+        }
+        else
+        {
+            const auto tick = (int64) std::round (ppq * MidiClock::ticksPerBeat);
+
+            report.numClockTicks++;
+
+            if (! running || tick != expectedTick)
+                report.numClockOutOfPhase++;
+
+            expectedTick = tick + 1;
+            events.clockTickSamples.push_back (sample);
+        }
+    }
+
+    static void applyParameters (AudioProcessor& processor, const Scenario& scenario)
+    {
+        for (auto* parameter : processor.getParameters())
+        {
+            if (auto* ranged = dynamic_cast<RangedAudioParameter*> (parameter))
+            {
+                for (auto& value : scenario.parameters)
+                {
+                    if (value.first == ranged->paramID)
+                        ranged->setValueNotifyingHost (ranged->convertTo0to1 (value.second));
+                }
+            }
+        }
+
+    }
+
+    static float getParameterValue (const Scenario& scenario, const String& parameterID)
+    {
+        for (auto& value : scenario.parameters)
+            if (value.first == parameterID)
+                return value.second;
+
+        return 0.0f;
+    }
+
+    /** Pairs every event with the nearest expected one, and counts expected
+        events left short and those that got more than their share.
+    */
+    static void match (const ExpectedEvents& expected, const std::vector<int64>& samples, double& maxError,
+                       double& meanError, int& numMissing, int& numDuplicated)
+    {
+        std::vector<int> hits (expected.size(), 0);
+        double totalError = 0.0;
+
+        for (auto sample : samples)
+        {
+            if (expected.empty())
+            {
+                numDuplicated++;
+                continue;
+            }
+
+            auto next = std::lower_bound (expected.begin(), expected.end(), (double) sample,
+                                          [] (const std::pair<double, int>& e, double s) { return e.first < s; });
+
+            if (next == expected.end()
+                 || (next != expected.begin() && (double) sample - std::prev (next)->first < next->first - (double) sample))
+                --next;
+
+            const double error = std::abs ((double) sample - next->first);
+            maxError = jmax (maxError, error);
+            totalError += error;
+            hits[(size_t) std::distance (expected.begin(), next)]++;
+        }
+
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            numMissing += jmax (0, expected[i].second - hits[i]);
+            numDuplicated += jmax (0, hits[i] - expected[i].second);
+        }
+
+        meanError = samples.empty() ? 0.0 : totalError / (double) samples.size();
+    }
+
+    /** Note-ons in events that the first render doesn't have at the same sample. */
+    static int countMismatched (const std::map<NoteKey, int>& first, const std::map<NoteKey, int>& events)
+    {
+        int numMismatched = 0;
+
+        for (auto& event : events)
+        {
+            auto found = first.find (event.first);
+            numMismatched += jmax (0, event.second - (found != first.end() ? found->second : 0));
+        }
+
+        return numMismatched;
+    }
+};
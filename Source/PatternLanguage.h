@@ -0,0 +1,352 @@
+/*
+  ==============================================================================
+
+    PatternLanguage.h
+
+    A small text language for step patterns, compiled on the message thread
+    into a flat, fixed-size instruction array that the audio thread steps
+    through without parsing, allocating or locking.
+
+        x..x .x.. [xx] x?
+
+    Each whitespace-separated group is one beat, and its steps split the beat
+    evenly. Within a group:
+
+        x       a hit
+        X       an accented hit
+        .       a rest
+        [x.x]   one step split into retriggers (up to 8 slots)
+        ?       after a step: it fires half the time
+        ?30     after a step: it fires 30% of the time
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "RhythmGenerators.h"
+#include "TripleBuffer.h"
+
+//==============================================================================
+struct PatternInstruction
+{
+    float offset;           // within the beat, in beats
+    float length;           // of the hit's slot, in beats
+    float probability;      // 0-1
+    uint8 step;             // hits of one step share its random draws
+    uint8 ratchet;          // position within a [..] group
+    uint8 velocity;         // 1-127
+};
+
+struct PatternProgram
+{
+    static constexpr int maxBeats = 64;
+    static constexpr int maxSubSteps = 8;
+    static constexpr int maxInstructions = 1024;
+
+    int getNumHits (int beat) const noexcept        { return beatStart[beat + 1] - beatStart[beat]; }
+
+    int numBeats = 0;
+    int numInstructions = 0;
+    float shortestLength = 1.0f;
+    int beatStart[maxBeats + 1] = {};
+    PatternInstruction instructions[maxInstructions];
+};
+
+//==============================================================================
+namespace PatternLanguage
+{
+    constexpr uint8 hitVelocity = 96;
+    constexpr uint8 accentVelocity = 127;
+
+    /** Compiles text into program. Returns an empty string on success, or a
+        description of the first error, in which case program is left empty.
+        Empty text compiles to an empty program.
+    */
+    inline String compile (const String& text, PatternProgram& program)
+    {
+        program.numBeats = 0;
+        program.numInstructions = 0;
+        program.shortestLength = 1.0f;
+        program.beatStart[0] = 0;
+
+        struct Step
+        {
+            uint8 velocities[PatternProgram::maxSubSteps];
+            int numSlots;
+            float probability;
+        };
+
+        auto fail = [&program] (const String& message)
+        {
+            program.numBeats = 0;
+            program.numInstructions = 0;
+            return message;
+        };
+
+        auto isSpace = [] (juce_wchar c)     { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; };
+        auto velocityFor = [] (juce_wchar c) { return c == 'X' ? accentVelocity : (c == 'x' ? hitVelocity : (uint8) 0); };
+
+        auto t = text.getCharPointer();
+
+        for (;;)
+        {
+            while (isSpace (*t))
+                ++t;
+
+            if (t.isEmpty())
+                break;
+
+            if (program.numBeats >= PatternProgram::maxBeats)
+                return fail ("A pattern can be at most " + String (PatternProgram::maxBeats) + " beats long");
+
+            Step steps[Rhythm::maxSteps];
+            int numSteps = 0;
+
+            while (! t.isEmpty() && ! isSpace (*t))
+            {
+                if (numSteps >= Rhythm::maxSteps)
+                    return fail ("Beat " + String (program.numBeats + 1) + " has more than " + String (Rhythm::maxSteps) + " steps");
+
+                auto& step = steps[numSteps++];
+                step.numSlots = 0;
+                step.probability = 1.0f;
+
+                const auto c = *t;
+                ++t;
+
+                if (c == 'x' || c == 'X' || c == '.')
+                {
+                    step.velocities[step.numSlots++] = velocityFor (c);
+                }
+                else if (c == '[')
+                {
+                    while (! t.isEmpty() && *t != ']')
+                    {
+                        const auto slot = *t;
+                        ++t;
+
+                        if (slot != 'x' && slot != 'X' && slot != '.')
+                            return fail ("Only x, X and . can go inside [ ]");
+
+                        if (step.numSlots >= PatternProgram::maxSubSteps)
+                            return fail ("A [ ] group can hold at most " + String (PatternProgram::maxSubSteps) + " slots");
+
+                        step.velocities[step.numSlots++] = velocityFor (slot);
+                    }
+
+                    if (t.isEmpty())
+                        return fail ("Missing ]");
+
+                    ++t;
+
+                    if (step.numSlots == 0)
+                        return fail ("Empty [ ] group");
+                }
+                else
+                {
+                    return fail ("Unexpected '" + String::charToString (c) + "'");
+                }
+
+                if (*t == '?')
+                {
+                    ++t;
+                    int percent = 0, numDigits = 0;
+
+                    while (*t >= '0' && *t <= '9')
+                    {
+                        percent = percent * 10 + (int) (*t - '0');
+                        ++numDigits;
+                        ++t;
+                    }
+
+                    if (percent > 100)
+                        return fail ("Probabilities go up to ?100");
+
+                    step.probability = numDigits == 0 ? 0.5f : (float) percent / 100.0f;
+                }
+            }
+
+            // flatten the beat into one instruction per hit
+            const float stepLength = 1.0f / (float) numSteps;
+
+            for (int s = 0; s < numSteps; ++s)
+            {
+                const auto& step = steps[s];
+                const float slotLength = stepLength / (float) step.numSlots;
+
+                for (int r = 0; r < step.numSlots; ++r)
+                {
+                    if (step.velocities[r] == 0)
+                        continue;
+
+                    if (program.numInstructions >= PatternProgram::maxInstructions)
+                        return fail ("The pattern has too many hits");
+
+                    program.instructions[program.numInstructions++] = { stepLength * (float) s + slotLength * (float) r, slotLength,
+                                                                        step.probability, (uint8) s, (uint8) r, step.velocities[r] };
+                    program.shortestLength = jmin (program.shortestLength, slotLength);
+                }
+            }
+
+            program.beatStart[++program.numBeats] = program.numInstructions;
+        }
+
+        return {};
+    }
+}
+
+//==============================================================================
+/** Owns the current pattern text and hands compiled programs to the beat
+    generator. Patterns are only ever compiled and published on the message
+    thread, so the program buffers have a single writer; setTextAsync() gets a
+    pattern there from any other thread, e.g. a host restoring state. Programs
+    are read by whichever thread is generating beats, which never waits for
+    the writer.
+
+    The program buffers are only allocated once a pattern is first set, so an
+    instance that never uses pattern mode doesn't pay for them.
+*/
+class PatternSlot  : private AsyncUpdater
+{
+public:
+    PatternSlot() = default;
+
+    ~PatternSlot() override
+    {
+        cancelPendingUpdate();
+    }
+
+    /** Message thread only. Compiles and, if that succeeds, publishes the new
+        pattern. Returns the compile error, if any, in which case the previous
+        pattern stays active. Replaces any text still waiting from setTextAsync().
+    */
+    String setText (const String& newText)
+    {
+        JUCE_ASSERT_MESSAGE_THREAD
+
+        {
+            const ScopedLock sl (textLock);
+            hasPendingText = false;
+        }
+
+        if (storage == nullptr)
+        {
+            if (newText.trim().isEmpty())
+            {
+                setCurrentText (newText);
+                return {};
+            }
+
+            storage = std::make_unique<TripleBuffer<PatternProgram>>();
+        }
+
+        auto& program = storage->getWriteBuffer();
+        const auto error = PatternLanguage::compile (newText, program);
+
+        if (error.isEmpty())
+        {
+            storage->publish();
+            programs.store (storage.get(), std::memory_order_release);
+            numPublished++;
+            setCurrentText (newText);
+        }
+
+        return error;
+    }
+
+    /** Any thread: sets the text on the message thread, or straight away if
+        called on it. Until then getText() already returns the new text.
+    */
+    void setTextAsync (const String& newText)
+    {
+        if (MessageManager::existsAndIsCurrentThread())
+        {
+            setText (newText);
+            return;
+        }
+
+        {
+            const ScopedLock sl (textLock);
+            pendingText = newText;
+            hasPendingText = true;
+        }
+
+        triggerAsyncUpdate();
+    }
+
+    /** Any thread. */
+    String getText() const
+    {
+        const ScopedLock sl (textLock);
+        return hasPendingText ? pendingText : text;
+    }
+
+    /** Bytes allocated on top of sizeof (PatternSlot). */
+    size_t getAllocatedBytes() const noexcept
+    {
+        return storage != nullptr ? sizeof (TripleBuffer<PatternProgram>) : 0;
+    }
+
+    //==============================================================================
+    /** Reader side: picks up the newest published program. Call this only where
+        switching pattern is allowed, i.e. at the start of a pattern cycle.
+    */
+    const PatternProgram& acquireProgram() noexcept
+    {
+        auto* current = programs.load (std::memory_order_acquire);
+        return current != nullptr ? current->acquire() : getEmptyProgram();
+    }
+
+    /** Reader side: the program from the last acquireProgram() call. */
+    const PatternProgram& getProgram() noexcept
+    {
+        auto* current = programs.load (std::memory_order_acquire);
+        return current != nullptr ? current->getReadBuffer() : getEmptyProgram();
+    }
+
+    /** Any thread: how many patterns have been published, so beats generated
+        ahead of time can tell they were made from an older one.
+    */
+    uint32 getNumPublished() const noexcept         { return numPublished; }
+
+private:
+    void handleAsyncUpdate() override
+    {
+        String newText;
+
+        {
+            const ScopedLock sl (textLock);
+
+            if (! hasPendingText)
+                return;
+
+            newText = pendingText;
+        }
+
+        setText (newText);
+    }
+
+    void setCurrentText (const String& newText)
+    {
+        const ScopedLock sl (textLock);
+        text = newText;
+    }
+
+    /** Shared by every slot that has no pattern yet. */
+    static const PatternProgram& getEmptyProgram() noexcept
+    {
+        static const PatternProgram empty {};
+        return empty;
+    }
+
+    std::unique_ptr<TripleBuffer<PatternProgram>> storage;     // only touched by the writer
+    std::atomic<TripleBuffer<PatternProgram>*> programs { nullptr };
+    std::atomic<uint32> numPublished { 0 };
+
+    CriticalSection textLock;      // never taken by the audio thread
+    String text, pendingText;
+    bool hasPendingText = false;
+
+    JUCE_DECLARE_NON_COPYABLE (PatternSlot)
+};
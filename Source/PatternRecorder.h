@@ -0,0 +1,341 @@
+/*
+  ==============================================================================
+
+    PatternRecorder.h
+
+    Captures every note the arpeggiator fires so a pattern that was just heard
+    can be kept. The audio thread only pushes into a preallocated lock-free
+    FIFO. The shared background thread drains it into a rolling history and,
+    on request, hands a copy of the history to an export job that writes the
+    last few bars out as a standard MIDI file or as pattern text, so file I/O
+    never holds up the beat lookahead of other instances. The recorder owns
+    the job's thread and waits for it when it is deleted. Nothing is allocated
+    until the first start(), and the export thread only on the first export.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "PatternLanguage.h"
+#include "SharedBackgroundThread.h"
+
+class PatternRecorder  : private TimeSliceClient
+{
+public:
+    struct Note
+    {
+        double ppqPosition;
+        double lengthInBeats;
+        double bpm;
+        int64 sampleTime;
+        int timeSigNumerator, timeSigDenominator;
+        uint8 channel, noteNumber, velocity;
+    };
+
+    static constexpr int maxBars = 16;
+    static constexpr int fifoSize = 1024;       // over 30 ms of notes at the event budget's limit
+    static constexpr int drainIntervalMs = 50;
+
+    using ExportCallback = std::function<void (const File&, bool succeeded)>;
+    using PatternCallback = std::function<void (const String& patternText)>;
+
+    //==============================================================================
+    PatternRecorder() = default;
+
+    ~PatternRecorder() override
+    {
+        stop();
+
+        // an export may still be writing; it has to finish before our code can be unloaded
+        exportPool.reset();
+    }
+
+    /** Allocates the FIFO and starts draining it. Call before the first record(),
+        e.g. from prepareToPlay.
+    */
+    void start()
+    {
+        const ScopedLock sl (exportLock);
+
+        if (buffer == nullptr)
+            buffer.allocate (fifoSize, false);
+
+        if (! isRunning)
+        {
+            isRunning = true;
+            thread->addClient (this);
+        }
+    }
+
+    void stop()
+    {
+        thread->removeTimeSliceClient (this);
+
+        const ScopedLock sl (exportLock);
+        isRunning = false;
+    }
+
+    /** Bytes allocated on top of sizeof (PatternRecorder), not counting the history. */
+    size_t getAllocatedBytes() const noexcept
+    {
+        return buffer != nullptr ? fifoSize * sizeof (Note) : 0;
+    }
+
+    //==============================================================================
+    /** Called on the audio thread for every fired note. Takes no locks and never
+        allocates; if the background thread has fallen behind the note is dropped.
+    */
+    void record (const Note& note) noexcept
+    {
+        jassert (buffer != nullptr);    // start() hasn't been called
+
+        int start1, size1, start2, size2;
+        fifo.prepareToWrite (1, start1, size1, start2, size2);
+
+        if (size1 + size2 == 0)
+        {
+            numDropped++;
+            return;
+        }
+
+        buffer[size1 > 0 ? start1 : start2] = note;
+        fifo.finishedWrite (1);
+    }
+
+    int getNumDropped() const noexcept      { return numDropped; }
+
+    //==============================================================================
+    /** Writes the last numBars bars to a MIDI file, off the message thread.
+        onComplete is called on the message thread once the file is written.
+    */
+    void exportLastBars (int numBars, const File& destination, ExportCallback onComplete)
+    {
+        ExportRequest request;
+        request.numBars = jlimit (1, maxBars, numBars);
+        request.destination = destination;
+        request.onFileWritten = std::move (onComplete);
+        post (std::move (request));
+    }
+
+    /** Turns the last numBars bars into pattern text on a grid of stepsPerBeat
+        steps, off the message thread. onComplete is called on the message
+        thread, with empty text if nothing was captured.
+    */
+    void captureLastBarsAsPattern (int numBars, int stepsPerBeat, PatternCallback onComplete)
+    {
+        ExportRequest request;
+        request.numBars = jlimit (1, maxBars, numBars);
+        request.stepsPerBeat = jlimit (1, Rhythm::maxSteps, stepsPerBeat);
+        request.onPatternReady = std::move (onComplete);
+        post (std::move (request));
+    }
+
+    static File getDefaultExportFile()
+    {
+        auto folder = File::getSpecialLocation (File::userDocumentsDirectory).getChildFile ("BeatPeggiator Captures");
+        folder.createDirectory();
+        return folder.getNonexistentChildFile ("Capture", ".mid");
+    }
+
+private:
+    struct ExportRequest
+    {
+        int numBars = 1;
+        int stepsPerBeat = 4;
+        File destination;
+        ExportCallback onFileWritten;
+        PatternCallback onPatternReady;
+    };
+
+    void post (ExportRequest request)
+    {
+        {
+            const ScopedLock sl (exportLock);
+
+            if (exportPool == nullptr)
+                exportPool = std::make_unique<ThreadPool> (1);
+
+            pendingExport = std::move (request);
+            exportPending = true;
+        }
+
+        start();
+        thread->moveToFrontOfQueue (this);
+    }
+
+    //==============================================================================
+    int useTimeSlice() override
+    {
+        drain();
+
+        const ScopedLock sl (exportLock);
+
+        // the export works on a copy, so draining carries on while it runs
+        if (exportPending)
+        {
+            exportPending = false;
+
+            auto request = std::move (pendingExport);
+            auto notes = history;
+            exportPool->addJob ([request, notes] { runExport (request, notes); });
+        }
+
+        return drainIntervalMs;
+    }
+
+    /** Runs on the export thread; touches nothing but its arguments. */
+    static void runExport (const ExportRequest& request, const std::vector<Note>& notes)
+    {
+        if (request.onPatternReady != nullptr)
+        {
+            auto patternText = toPatternText (notes, request.numBars, request.stepsPerBeat);
+            auto callback = request.onPatternReady;
+
+            MessageManager::callAsync ([callback, patternText] { callback (patternText); });
+        }
+        else
+        {
+            const bool succeeded = writeMidiFile (notes, request.numBars, request.destination);
+            auto file = request.destination;
+            auto callback = request.onFileWritten;
+
+            if (callback != nullptr)
+                MessageManager::callAsync ([callback, file, succeeded] { callback (file, succeeded); });
+        }
+    }
+
+    void drain()
+    {
+        int start1, size1, start2, size2;
+        fifo.prepareToRead (fifo.getNumReady(), start1, size1, start2, size2);
+
+        for (int i = 0; i < size1; ++i)
+            addToHistory (buffer[start1 + i]);
+
+        for (int i = 0; i < size2; ++i)
+            addToHistory (buffer[start2 + i]);
+
+        fifo.finishedRead (size1 + size2);
+    }
+
+    void addToHistory (const Note& note)
+    {
+        // a loop or relocation jumped backwards, so this is a new take
+        if (! history.empty() && note.ppqPosition < history.back().ppqPosition)
+            history.clear();
+
+        history.push_back (note);
+
+        const double oldestKept = note.ppqPosition - maxBars * getBeatsPerBar (note);
+        auto firstKept = std::find_if (history.begin(), history.end(),
+                                       [oldestKept] (const Note& n) { return n.ppqPosition >= oldestKept; });
+        history.erase (history.begin(), firstKept);
+    }
+
+    static double getBeatsPerBar (const Note& note)
+    {
+        return note.timeSigNumerator * 4.0 / jmax (1, note.timeSigDenominator);
+    }
+
+    /** Start of the last numBars whole bars of notes, in ppq. */
+    static double getStartOfLastBars (const std::vector<Note>& notes, int numBars)
+    {
+        const auto& last = notes.back();
+        const double beatsPerBar = getBeatsPerBar (last);
+        const double end = std::ceil ((last.ppqPosition + last.lengthInBeats) / beatsPerBar) * beatsPerBar;
+        return end - numBars * beatsPerBar;
+    }
+
+    //==============================================================================
+    static bool writeMidiFile (const std::vector<Note>& notes, int numBars, const File& destination)
+    {
+        if (notes.empty())
+            return false;
+
+        const auto& last = notes.back();
+        const double start = getStartOfLastBars (notes, numBars);
+        const int ticksPerBeat = 960;
+
+        MidiMessageSequence sequence;
+        sequence.addEvent (MidiMessage::tempoMetaEvent (roundToInt (60000000.0 / last.bpm)), 0);
+        sequence.addEvent (MidiMessage::timeSignatureMetaEvent (last.timeSigNumerator, last.timeSigDenominator), 0);
+
+        for (const auto& note : notes)
+        {
+            if (note.ppqPosition < start)
+                continue;
+
+            const double onTick = (note.ppqPosition - start) * ticksPerBeat;
+            const double offTick = onTick + note.lengthInBeats * ticksPerBeat;
+
+            sequence.addEvent (MidiMessage::noteOn (note.channel, note.noteNumber, note.velocity), onTick);
+            sequence.addEvent (MidiMessage::noteOff (note.channel, note.noteNumber), offTick);
+        }
+
+        sequence.updateMatchedPairs();
+
+        MidiFile midiFile;
+        midiFile.setTicksPerQuarterNote (ticksPerBeat);
+        midiFile.addTrack (sequence);
+
+        destination.deleteFile();
+        FileOutputStream stream (destination);
+
+        return stream.openedOk() && midiFile.writeTo (stream);
+    }
+
+    /** Quantises the captured notes onto the step grid, one group per beat; a
+        step that caught several notes becomes a [..] group of retriggers.
+    */
+    static String toPatternText (const std::vector<Note>& notes, int numBars, int stepsPerBeat)
+    {
+        if (notes.empty())
+            return {};
+
+        const double start = std::floor (getStartOfLastBars (notes, numBars));
+        const int numBeats = jmin (PatternProgram::maxBeats, roundToInt (numBars * getBeatsPerBar (notes.back())));
+        std::vector<int> hits ((size_t) (numBeats * stepsPerBeat), 0);
+
+        for (const auto& note : notes)
+        {
+            const int slot = (int) std::floor ((note.ppqPosition - start) * stepsPerBeat + 0.5);
+
+            if (isPositiveAndBelow (slot, (int) hits.size()))
+                hits[(size_t) slot]++;
+        }
+
+        String text;
+
+        for (int beat = 0; beat < numBeats; ++beat)
+        {
+            if (beat > 0)
+                text << " ";
+
+            for (int step = 0; step < stepsPerBeat; ++step)
+            {
+                const int count = jmin (PatternProgram::maxSubSteps, hits[(size_t) (beat * stepsPerBeat + step)]);
+                text << (count == 0 ? String (".") : count == 1 ? String ("x") : "[" + String::repeatedString ("x", count) + "]");
+            }
+        }
+
+        return text;
+    }
+
+    //==============================================================================
+    AbstractFifo fifo { fifoSize };
+    HeapBlock<Note> buffer;
+    std::atomic<int> numDropped { 0 };
+
+    std::vector<Note> history;     // only touched by the background thread
+
+    CriticalSection exportLock;    // never taken by the audio thread
+    ExportRequest pendingExport;
+    bool exportPending = false;
+    bool isRunning = false;
+    std::unique_ptr<ThreadPool> exportPool;     // created by the first export, joined on deletion
+
+    SharedResourcePointer<SharedBackgroundThread> thread;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PatternRecorder)
+};
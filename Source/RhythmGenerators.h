@@ -0,0 +1,189 @@
+/*
+  ==============================================================================
+
+    RhythmGenerators.h
+
+    Step-placement algorithms used by BeatGenerator::generateBeatMap.
+    The Euclidean and accent masks for every (numNotes, beatDivision) pair are
+    built at compile time, so picking one is a table read on whichever thread
+    generates the beat.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+namespace Rhythm
+{
+    //==============================================================================
+    enum class Algorithm
+    {
+        random = 0,
+        euclidean,
+        density,
+        accent,
+        pattern     // steps come from PatternLanguage text instead of numNotes / beatDivision
+    };
+
+    inline StringArray getAlgorithmNames()
+    {
+        return { "Random", "Euclidean", "Density", "Accent", "Pattern" };
+    }
+
+    //==============================================================================
+    /** One bit per step, bit 0 being the first step of the beat. */
+    using StepMask = uint16;
+
+    constexpr int maxSteps = 16;
+
+    struct MaskTable
+    {
+        constexpr StepMask get (int numNotes, int numSteps) const
+        {
+            return masks[numNotes][numSteps];
+        }
+
+        StepMask masks[maxSteps + 1][maxSteps + 1];
+    };
+
+    //==============================================================================
+    /** Bresenham form of Bjorklund's algorithm. It yields the same maximally even
+        onset set (up to rotation) and always puts an onset on step 0.
+    */
+    constexpr StepMask euclideanMask (int numNotes, int numSteps)
+    {
+        StepMask mask = 0;
+
+        for (int i = 0; i < numSteps; ++i)
+            if ((i * numNotes) % numSteps < numNotes)
+                mask = (StepMask) (mask | (1u << i));
+
+        return mask;
+    }
+
+    /** Metric weight of a step: the beat splits into halves, else thirds, else
+        groups of two closed by a three (5 = 2+3, 7 = 2+2+3), and each group
+        splits the same way. A step weighs more the fewer splits it takes to
+        become the start of a group, so the downbeat is heaviest.
+    */
+    constexpr int metricWeight (int step, int numSteps)
+    {
+        int weight = maxSteps;
+
+        while (step != 0)
+        {
+            if (numSteps % 2 == 0 || numSteps % 3 == 0)
+            {
+                numSteps /= (numSteps % 2 == 0 ? 2 : 3);
+                step %= numSteps;
+            }
+            else if (step < numSteps - 3)
+            {
+                numSteps = 2;
+                step %= 2;
+            }
+            else
+            {
+                step -= numSteps - 3;
+                numSteps = 3;
+            }
+
+            --weight;
+        }
+
+        return weight;
+    }
+
+    /** Accent template: the Euclidean onsets, rotated so that one sits on the
+        downbeat and the rest land on the heaviest steps of the grouping above.
+        Keeping the Euclidean spacing means no count bunches its accents, and
+        the rotation is what puts 2 in 5 on the 2+3 grouping and 3 in 7 on 2+2+3.
+    */
+    constexpr StepMask accentMask (int numNotes, int numSteps)
+    {
+        int weights[maxSteps] {};
+
+        for (int i = 0; i < numSteps; ++i)
+            weights[i] = metricWeight (i, numSteps);
+
+        const auto onsets = euclideanMask (numNotes, numSteps);
+        StepMask best = 0;
+        int bestWeight = -1;
+
+        for (int start = 0; start < numSteps; ++start)
+        {
+            if ((onsets & (1u << start)) == 0)
+                continue;
+
+            StepMask mask = 0;
+            int weight = 0;
+
+            for (int i = 0; i < numSteps; ++i)
+            {
+                if ((onsets & (1u << i)) != 0)
+                {
+                    const int step = (i - start + numSteps) % numSteps;
+                    mask = (StepMask) (mask | (1u << step));
+                    weight += weights[step];
+                }
+            }
+
+            if (weight > bestWeight)
+            {
+                best = mask;
+                bestWeight = weight;
+            }
+        }
+
+        return best;
+    }
+
+    constexpr MaskTable makeEuclideanTable()
+    {
+        MaskTable table {};
+
+        for (int steps = 1; steps <= maxSteps; ++steps)
+            for (int notes = 0; notes <= maxSteps; ++notes)
+                table.masks[notes][steps] = euclideanMask (notes < steps ? notes : steps, steps);
+
+        return table;
+    }
+
+    constexpr MaskTable makeAccentTable()
+    {
+        MaskTable table {};
+
+        for (int steps = 1; steps <= maxSteps; ++steps)
+            for (int notes = 0; notes <= maxSteps; ++notes)
+                table.masks[notes][steps] = accentMask (notes < steps ? notes : steps, steps);
+
+        return table;
+    }
+
+    constexpr MaskTable euclideanTable = makeEuclideanTable();
+    constexpr MaskTable accentTable    = makeAccentTable();
+
+    static_assert (euclideanTable.get (3, 8) == 0x49, "E(3,8) should be x..x..x.");
+    static_assert (euclideanTable.get (4, 4) == 0x0f, "E(4,4) should fill every step");
+    static_assert (accentTable.get (2, 8) == 0x11, "two accents in 8 steps land on 0 and 4");
+    static_assert (accentTable.get (2, 5) == 0x05, "two accents in 5 steps follow 2+3: x.x..");
+    static_assert (accentTable.get (3, 7) == 0x15, "three accents in 7 steps follow 2+2+3: x.x.x..");
+    static_assert (accentTable.get (5, 8) == 0xb5, "five accents in 8 steps stay spread: x.x.xx.x");
+
+    //==============================================================================
+    /** Rotates a mask of numSteps steps later in time by rotation steps. */
+    constexpr StepMask rotate (StepMask mask, int rotation, int numSteps)
+    {
+        rotation %= numSteps;
+
+        if (rotation == 0)
+            return mask;
+
+        const uint32 all = (1u << numSteps) - 1u;
+        return (StepMask) (((mask << rotation) | (mask >> (numSteps - rotation))) & all);
+    }
+
+    static_assert (rotate (0x49, 1, 8) == 0x92, "rotation moves onsets later");
+    static_assert (rotate (0x80, 1, 8) == 0x01, "rotation wraps around the beat");
+}
@@ -0,0 +1,47 @@
+/*
+  ==============================================================================
+
+    SharedBackgroundThread.h
+
+    The one background thread every instance in the process shares, for beat
+    lookahead and capture draining. Clients keep their slices short and
+    bounded; anything that can block, like writing a file, goes to a thread
+    of its own. Hold it through a SharedResourcePointer.
+    It is only started once the first client is added, so instances that a
+    host merely scans or loads without playing never start a thread.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+struct SharedBackgroundThread  : public TimeSliceThread
+{
+    SharedBackgroundThread()  : TimeSliceThread ("BeatPeggiator background")
+    {
+    }
+
+    ~SharedBackgroundThread() override
+    {
+        stopThread (2000);
+    }
+
+    /** Use this rather than addTimeSliceClient(). Instances may be prepared on
+        different threads, hence the lock.
+    */
+    void addClient (TimeSliceClient* client, int msBeforeFirstCall = 0)
+    {
+        addTimeSliceClient (client, msBeforeFirstCall);
+
+        const ScopedLock sl (startLock);
+
+        if (! isThreadRunning())
+            startThread();
+    }
+
+private:
+    CriticalSection startLock;
+
+    JUCE_DECLARE_NON_COPYABLE (SharedBackgroundThread)
+};
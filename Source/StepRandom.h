@@ -0,0 +1,84 @@
+/*
+  ==============================================================================
+
+    StepRandom.h
+
+    Counter-based random numbers for the step timeline. Each draw is a pure
+    function of (seed, stream, counter), with no state carried from one draw
+    to the next. A whole beat's worth of draws is produced by one loop the
+    compiler can vectorise, and the same seed always gives the same pattern
+    however the host splits its buffers.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "RhythmGenerators.h"
+
+namespace StepRandom
+{
+    //==============================================================================
+    /** Independent draw streams; each one gets its own key. */
+    enum Stream : uint32
+    {
+        placementStream = 1,
+        fireStream,
+        velocityStream,
+        timingStream,
+        noteStream
+    };
+
+    /** 32-bit integer finaliser (lowbias32). Only uses operations that every SIMD
+        instruction set has, so loops over it vectorise.
+    */
+    inline uint32 hash (uint32 x) noexcept
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    inline uint32 makeKey (uint32 seed, uint32 cycle, Stream stream) noexcept
+    {
+        return hash (seed ^ hash (cycle * 0x9e3779b9u + (uint32) stream));
+    }
+
+    /** Maps the top 24 bits onto [0, 1). */
+    inline float toUnitFloat (uint32 x) noexcept
+    {
+        return (float) (x >> 8) * (1.0f / 16777216.0f);
+    }
+
+    /** Fills dest[0..num) with uniform floats in [0, 1). */
+    inline void fill (float* dest, int num, uint32 key) noexcept
+    {
+        for (int i = 0; i < num; ++i)
+            dest[i] = toUnitFloat (hash (key + (uint32) i * 0x9e3779b9u));
+    }
+
+    //==============================================================================
+    /** Every random number one beat needs, drawn in a single batch when the beat
+        is generated. Stored as one array per stream so each fill is a contiguous loop.
+    */
+    struct BeatDraws
+    {
+        void generate (uint32 seed, uint32 cycle) noexcept
+        {
+            fill (placement, Rhythm::maxSteps, makeKey (seed, cycle, placementStream));
+            fill (fire,      Rhythm::maxSteps, makeKey (seed, cycle, fireStream));
+            fill (velocity,  Rhythm::maxSteps, makeKey (seed, cycle, velocityStream));
+            fill (timing,    Rhythm::maxSteps, makeKey (seed, cycle, timingStream));
+            fill (note,      Rhythm::maxSteps, makeKey (seed, cycle, noteStream));
+        }
+
+        float placement[Rhythm::maxSteps];
+        float fire[Rhythm::maxSteps];
+        float velocity[Rhythm::maxSteps];
+        float timing[Rhythm::maxSteps];
+        float note[Rhythm::maxSteps];
+    };
+}
@@ -0,0 +1,64 @@
+/*
+  ==============================================================================
+
+    TripleBuffer.h
+
+    Wait-free single-writer / single-reader handoff of a value too large to be
+    atomic. The writer fills its private back buffer and publishes it with one
+    atomic pointer exchange. The reader picks up the newest published buffer
+    with another exchange. A buffer the reader has let go of is retired by
+    becoming the writer's next back buffer, so nothing is ever freed or
+    allocated and neither side ever waits for the other.
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+template <typename Type>
+class TripleBuffer
+{
+public:
+    TripleBuffer()
+    {
+        static_assert (alignof (Type) > 1, "the low pointer bit is used as the fresh flag");
+    }
+
+    //==============================================================================
+    /** Writer side: the buffer to fill before calling publish(). */
+    Type& getWriteBuffer() noexcept                 { return *back; }
+
+    /** Writer side: hands the write buffer to the reader. */
+    void publish() noexcept
+    {
+        const auto previous = middle.exchange (toBits (back) | freshFlag, std::memory_order_acq_rel);
+        back = fromBits (previous);
+    }
+
+    //==============================================================================
+    /** Reader side: swaps in the newest published buffer, if there is one. */
+    Type& acquire() noexcept
+    {
+        if ((middle.load (std::memory_order_relaxed) & freshFlag) != 0)
+            front = fromBits (middle.exchange (toBits (front), std::memory_order_acq_rel));
+
+        return *front;
+    }
+
+    /** Reader side: the buffer last returned by acquire(). */
+    Type& getReadBuffer() noexcept                  { return *front; }
+
+private:
+    static constexpr uintptr_t freshFlag = 1;
+
+    static uintptr_t toBits (Type* buffer) noexcept         { return reinterpret_cast<uintptr_t> (buffer); }
+    static Type* fromBits (uintptr_t bits) noexcept         { return reinterpret_cast<Type*> (bits & ~freshFlag); }
+
+    Type buffers[3];
+    Type* front = buffers;
+    Type* back = buffers + 2;
+    std::atomic<uintptr_t> middle { toBits (buffers + 1) };
+
+    JUCE_DECLARE_NON_COPYABLE (TripleBuffer)
+};
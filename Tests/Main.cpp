@@ -0,0 +1,78 @@
+/*
+  ==============================================================================
+
+    Main.cpp
+
+    Console runner for the offline stress test and the instance benchmark.
+    Exits non-zero if the stress test fails or an instance is over its
+    memory budget, so it can gate a build. Those checks come out the same on
+    every run; the timings are printed but gate nothing, as they vary with
+    the machine and the build.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../Source/OfflineHarness.h"
+#include "../Source/InstanceBenchmark.h"
+
+#if JUCE_MAC
+ #include <malloc/malloc.h>
+#elif JUCE_LINUX || JUCE_WINDOWS
+ #include <malloc.h>
+#endif
+
+//==============================================================================
+#if JUCE_MAC || JUCE_LINUX || JUCE_WINDOWS
+/** Bytes the C runtime heap has handed out and not had back. Everything that
+    goes through new or malloc on this thread is counted, so JUCE's objects are
+    measured along with the plugin's own.
+*/
+static int64 getLiveHeapBytes()
+{
+   #if JUCE_MAC
+    malloc_statistics_t stats;
+    malloc_zone_statistics (nullptr, &stats);
+    return (int64) stats.size_in_use;
+   #elif JUCE_LINUX
+    // the main arena only, which is where the message thread allocates
+   #if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+    return (int64) mallinfo2().uordblks;
+   #else
+    return (int64) (unsigned int) mallinfo().uordblks;
+   #endif
+   #elif JUCE_WINDOWS
+    int64 total = 0;
+    _HEAPINFO entry = {};
+
+    while (_heapwalk (&entry) == _HEAPOK)
+        if (entry._useflag == _USEDENTRY)
+            total += (int64) entry._size;
+
+    return total;
+   #endif
+}
+#endif
+
+//==============================================================================
+int main (int, char*[])
+{
+    // the benchmark opens editors, which needs a message thread
+    ScopedJuceInitialiser_GUI juceInitialiser;
+
+   #if JUCE_MAC || JUCE_LINUX || JUCE_WINDOWS
+    InstanceBenchmark::setHeapMeter (getLiveHeapBytes);
+   #endif
+
+    const auto stressTest = OfflineHarness::runStressTest();
+    std::cout << stressTest << std::endl << std::endl;
+
+    const auto benchmark = InstanceBenchmark::run (256, true);
+    std::cout << benchmark.toString() << std::endl << std::endl;
+
+    const auto layouts = InstanceBenchmark::compareLayouts();
+    std::cout << layouts.toString() << std::endl;
+
+    const bool passed = stressTest.endsWith ("PASSED") && benchmark.isWithinMemoryBudget();
+    return passed ? 0 : 1;
+}